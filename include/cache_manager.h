@@ -0,0 +1,67 @@
+#ifndef RSJFW_CACHE_MANAGER_H
+#define RSJFW_CACHE_MANAGER_H
+
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace rsjfw {
+
+// Keeps ~/.rsjfw under a disk budget by evicting whole entries (a cached
+// package, a download, a Studio version) least recently used first. The
+// newest installed version and the last one launched (by its touchVersion
+// marker) are never evicted.
+class CacheManager {
+public:
+  struct Usage {
+    uintmax_t cache = 0;     // package zips, font and WebView2 blobs
+    uintmax_t versions = 0;  // version files the content store does not hold
+    uintmax_t store = 0;     // content store objects
+    uintmax_t downloads = 0; // runner and DXVK archives
+
+    uintmax_t total() const { return cache + versions + store + downloads; }
+  };
+
+  struct Report {
+    Usage before;
+    Usage after; // equals before on a dry run
+    uintmax_t freed = 0;
+    std::vector<std::string> evicted;
+  };
+
+  static CacheManager &instance();
+
+  Usage usage();
+
+  // Evicts until the total fits in budget bytes. With dryRun, only lists
+  // what would go.
+  Report collect(uintmax_t budget, bool dryRun = false);
+
+  // Marks guid as used now, for LRU ordering.
+  void touchVersion(const std::string &guid);
+
+  // The configured budget in bytes, 0 when collection is disabled.
+  static uintmax_t configuredBudget();
+  static std::string formatSize(uintmax_t bytes);
+
+private:
+  CacheManager() = default;
+
+  struct Entry {
+    std::filesystem::path path;
+    uintmax_t bytes = 0;
+    time_t lastUsed = 0;
+    bool version = false;
+  };
+
+  Usage scan(std::vector<Entry> *entries);
+
+  std::mutex mtx_;
+};
+
+} // namespace rsjfw
+
+#endif
@@ -63,6 +63,10 @@ struct GeneralConfig {
   std::string selectedGpu = "";
   bool hideLauncher = false;
   bool autoApplyFixes = true;
+  bool keepPackageCache = false; // keep downloaded package zips for offline reinstall
+  bool prefetchUpdates = true; // install new studio versions in the background
+  int prefetchRateKb = 4096;   // KB/s cap for background installs, 0 for none
+  int diskBudgetGb = 20;       // ~/.rsjfw size before old entries are evicted, 0 to never
   bool enableMangoHud = false;
   bool enableFsync = true;
   bool enableEsync = true;
@@ -0,0 +1,79 @@
+#ifndef RSJFW_CONTENT_STORE_H
+#define RSJFW_CONTENT_STORE_H
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "common.h"
+
+namespace rsjfw {
+
+// Content-addressed object store shared by all installed Studio versions.
+// Files are keyed by XXH64 and size; a version directory ends up as a tree
+// of reflinks (btrfs/xfs) or hardlinks to the objects, so identical files
+// across versions take disk space once.
+//
+// Reflinked files stay independent copies. Hardlinked ones share one inode
+// with the object and every other version, so they are made read-only: an
+// in-place write (a Studio self-patch, a hand edit) fails instead of
+// silently changing every version. Anything that rewrites a file under
+// versions/ must unlink or rename over it rather than open it for writing.
+class ContentStore {
+public:
+  struct Stats {
+    size_t files = 0;
+    size_t deduped = 0;
+    uintmax_t bytesSaved = 0;
+  };
+
+  static ContentStore &instance();
+
+  // Moves every regular file under dir into the store, replacing it with a
+  // link to the stored object, and records the objects dir references.
+  // Files listed in known (relative path -> object) are trusted unhashed.
+  // Stops between files once cancel is set, recording what it got through.
+  Stats ingest(const std::filesystem::path &dir, ProgressCallback cb = nullptr,
+               const std::unordered_map<std::string, std::string> *known =
+                   nullptr,
+               const std::atomic<bool> *cancel = nullptr);
+
+  // Relative path -> object name for a directory ingested earlier.
+  std::unordered_map<std::string, std::string>
+  references(const std::filesystem::path &dir);
+
+  // Places a copy of from at to, as a reflink or hardlink when possible.
+  bool materialize(const std::filesystem::path &from,
+                   const std::filesystem::path &to);
+
+  // Drops objects that no directory under PathManager::versions()
+  // references any more.
+  size_t prune();
+
+  static uint64_t hashFile(const std::filesystem::path &path, bool &ok);
+
+private:
+  ContentStore();
+
+  enum class LinkMode { Unknown, Reflink, Hardlink, None };
+
+  static std::string objectName(uint64_t hash, uintmax_t size);
+  std::filesystem::path objectPath(const std::string &name) const;
+  bool linkInto(const std::filesystem::path &object,
+                const std::filesystem::path &target);
+  bool adopt(const std::filesystem::path &file,
+             const std::filesystem::path &object);
+
+  std::filesystem::path root_;
+  // Probed by the first adopt under probeMtx_, read lock-free by the
+  // foreground install and the background prefetch alike.
+  std::atomic<LinkMode> mode_{LinkMode::Unknown};
+  std::mutex probeMtx_;
+};
+
+} // namespace rsjfw
+
+#endif
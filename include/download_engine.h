@@ -0,0 +1,134 @@
+#ifndef RSJFW_DOWNLOAD_ENGINE_H
+#define RSJFW_DOWNLOAD_ENGINE_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <curl/curl.h>
+
+namespace rsjfw {
+
+    // Single curl_multi handle driven by one event-loop thread. Every transfer
+    // shares the multi's connection pool plus a CURLSH holding DNS and TLS
+    // sessions, and HTTP/2 streams to the same host are multiplexed onto one
+    // connection. All callbacks of a Request run on the event-loop thread.
+    class DownloadEngine {
+    public:
+        struct Request {
+            std::string url;
+            std::vector<std::string> headers;
+            // "first-last" byte range, empty for the whole resource.
+            std::string range;
+            long connectTimeout = 15;
+            bool headOnly = false;
+            // When false the transfer gets its own HTTP/1.1 connection instead
+            // of becoming a stream on a shared HTTP/2 connection.
+            bool multiplex = true;
+            // Raw response header lines, including those of redirects.
+            std::function<void(std::string_view line)> onHeader;
+            // Return fewer bytes than given to abort the transfer, or
+            // CURL_WRITEFUNC_PAUSE to leave them undelivered until resume().
+            std::function<size_t(const char* data, size_t len)> onData;
+            // Return false to abort the transfer.
+            std::function<bool(curl_off_t total, curl_off_t now)> onProgress;
+        };
+
+        struct Result {
+            CURLcode code = CURLE_OK;
+            long status = 0;
+            curl_off_t bytes = 0;
+            curl_off_t contentLength = -1;
+            std::string effectiveUrl;
+
+            bool ok() const { return code == CURLE_OK && (status == 0 || status < 400); }
+        };
+
+        using Id = uint64_t;
+        using DoneCallback = std::function<void(const Result&)>;
+
+        // Work nobody is waiting on. Transfers submitted under a Background
+        // split its bandwidth cap evenly between them and are aborted once
+        // cancel is set. The object must outlive its transfers.
+        struct Background {
+            curl_off_t maxBytesPerSec = 0;
+            std::atomic<bool> cancel{false};
+        };
+
+        // Tags transfers submitted from the current thread with bg until
+        // the scope ends. Threads spawned inside do not inherit it.
+        class BackgroundScope {
+        public:
+            explicit BackgroundScope(Background* bg);
+            ~BackgroundScope();
+            BackgroundScope(const BackgroundScope&) = delete;
+            BackgroundScope& operator=(const BackgroundScope&) = delete;
+
+        private:
+            Background* prev_;
+        };
+
+        // The Background of the current thread's innermost scope, if any.
+        static Background* currentBackground();
+
+        static DownloadEngine& instance();
+
+        // Queues a transfer; onDone fires once on the event-loop thread.
+        Id submit(Request req, DoneCallback onDone);
+        // Queues a transfer and blocks the caller until it finishes.
+        Result perform(Request req);
+        // Aborts a queued or running transfer with CURLE_ABORTED_BY_CALLBACK.
+        void cancel(Id id);
+        // Unpauses a transfer whose onData returned CURL_WRITEFUNC_PAUSE.
+        void resume(Id id);
+
+    private:
+        DownloadEngine();
+        ~DownloadEngine();
+        DownloadEngine(const DownloadEngine&) = delete;
+        DownloadEngine& operator=(const DownloadEngine&) = delete;
+
+        struct Transfer {
+            Id id = 0;
+            CURL* easy = nullptr;
+            curl_slist* headers = nullptr;
+            Request req;
+            DoneCallback onDone;
+            Background* bg = nullptr;
+        };
+
+        static size_t writeCallback(char* ptr, size_t size, size_t nmemb, void* userp);
+        static size_t headerCallback(char* ptr, size_t size, size_t nmemb, void* userp);
+        static int progressCallback(void* clientp, curl_off_t dltotal, curl_off_t dlnow,
+                                    curl_off_t ultotal, curl_off_t ulnow);
+
+        void run();
+        void start(Transfer* t);
+        void finish(Transfer* t, CURLcode code);
+        void throttleBackground();
+
+        CURLM* multi_ = nullptr;
+        CURLSH* share_ = nullptr;
+        std::thread loop_;
+        std::atomic<bool> stop_{false};
+        std::atomic<Id> nextId_{1};
+
+        std::mutex mtx_;
+        std::vector<Transfer*> pending_;
+        std::vector<Id> cancelled_;
+        std::vector<Id> resumed_;
+
+        // Owned by the event-loop thread.
+        std::unordered_map<Id, Transfer*> active_;
+        bool backgroundChanged_ = false;
+    };
+
+}
+
+#endif
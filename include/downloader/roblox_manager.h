@@ -4,7 +4,9 @@
 #include <string>
 #include <vector>
 #include <filesystem>
+#include <map>
 #include <queue>
+#include <unordered_map>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
@@ -24,12 +26,45 @@ public:
     bool deleteVersion(const std::string& guid);
 
     bool downloadPackage(const std::string& guid, const RobloxPackage& pkg, const std::string& targetDir, rsjfw::ProgressCallback cb);
-    bool extractPackage(const std::string& guid, const RobloxPackage& pkg, const std::string& targetDir, rsjfw::ProgressCallback cb);
+    // files, when given, receives the extracted paths relative to targetDir.
+    bool extractPackage(const std::string& guid, const RobloxPackage& pkg, const std::string& targetDir, rsjfw::ProgressCallback cb,
+                        std::vector<std::string>* files = nullptr);
+    // Extracts while downloading; the cache copy is only written when
+    // keepPackageCache is set.
+    bool streamPackage(const std::string& guid, const RobloxPackage& pkg, const std::string& targetDir,
+                       rsjfw::ProgressCallback downloadCb, rsjfw::ProgressCallback extractCb,
+                       std::vector<std::string>* files = nullptr);
+    bool isPackageCached(const std::string& guid, const RobloxPackage& pkg);
 
 private:
     RobloxManager();
     std::filesystem::path versionsDir_;
     std::string getDestinationSubfolder(const std::string& zipName);
+
+    // A package extracted in an installed version, keyed by name and checksum.
+    struct InstalledPackage {
+        std::filesystem::path dir;
+        std::vector<std::string> files;
+    };
+
+    std::unordered_map<std::string, InstalledPackage> findInstalledPackages(const std::string& exclude);
+    bool reusePackage(const std::filesystem::path& from, const std::filesystem::path& to, const std::vector<std::string>& files);
+    void writePackageIndex(const std::filesystem::path& dir, const std::vector<RobloxPackage>& pkgs,
+                           const std::map<std::string, std::vector<std::string>>& files);
+
+    struct VerifiedEntry {
+        std::string checksum;
+        uintmax_t size = 0;
+        long long mtime = 0;
+    };
+
+    bool verifyCached(const std::filesystem::path& path, const std::string& checksum);
+    void markVerified(const std::filesystem::path& path, const std::string& checksum);
+    void loadVerifiedIndex();
+
+    std::mutex indexMtx_;
+    bool indexLoaded_ = false;
+    std::unordered_map<std::string, VerifiedEntry> verified_;
 };
 
 }
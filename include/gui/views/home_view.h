@@ -2,6 +2,7 @@
 #define HOME_VIEW_H
 
 #include "gui/view.h"
+#include "cache_manager.h"
 #include "credential_manager.h"
 #include <vector>
 #include <string>
@@ -21,6 +22,12 @@ private:
     std::atomic<bool> refreshing_{false};
     std::mutex usersMtx_;
     void refreshUsers();
+
+    CacheManager::Usage usage_;
+    bool usageLoaded_ = false;
+    std::atomic<bool> scanning_{false};
+    std::mutex usageMtx_;
+    void refreshUsage(bool collect = false);
 };
 
 
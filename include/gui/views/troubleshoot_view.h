@@ -2,6 +2,9 @@
 #define TROUBLESHOOT_VIEW_H
 
 #include "gui/view.h"
+#include "registry.h"
+#include <optional>
+#include <string>
 
 namespace rsjfw {
 
@@ -9,6 +12,13 @@ class TroubleshootView : public View {
 public:
     void render() override;
     const char* getName() const override { return "Troubleshooting"; }
+
+private:
+    // Registry of the runner prefix as it was when the user last pressed
+    // "checkpoint prefix registry"; "revert prefix registry" restores it.
+    // Held only until then, as it makes the next write copy the whole hive.
+    std::string baselinePrefix_;
+    std::optional<Registry::Snapshot> baseline_;
 };
 
 }
@@ -1,22 +1,46 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <functional>
+#include <memory>
 #include <string>
 #include "common.h"
 
-#include <curl/curl.h>
-
 namespace rsjfw {
 
     class HTTP {
     public:
         static std::string get(const std::string& url);
-        static bool download(const std::string& url, const std::string& destPath, ProgressCallback cb = nullptr);
+        // When md5 is given the body is hashed as it is written and a
+        // mismatch counts as a failed attempt. knownSize, when the caller
+        // has it (e.g. from a manifest), saves the HEAD request for files
+        // too small to download in segments.
+        static bool download(const std::string& url, const std::string& destPath, ProgressCallback cb = nullptr,
+                             const std::string& md5 = "", long long knownSize = -1);
+        static bool checksumMatches(const std::string& digest, const std::string& expected);
+    };
+
+    // A GET whose body is consumed on the calling thread while the download
+    // engine keeps receiving. The transfer is paused whenever maxBuffered
+    // bytes are waiting to be read.
+    class HTTPStream {
+    public:
+        // Sees every chunk on the reading thread, in order, before read()
+        // returns it; return false to abort the transfer.
+        using Tap = std::function<bool(const char* data, size_t len)>;
+
+        HTTPStream(const std::string& url, ProgressCallback cb = nullptr, Tap tap = nullptr,
+                   size_t maxBuffered = 8 << 20);
+        ~HTTPStream();
+
+        // Blocks for the next block of the body and returns its size, 0 at
+        // the end of a successful body and -1 on failure. The block stays
+        // valid until the next call.
+        long read(const void** block);
 
     private:
-        static size_t writeCallback(void* contents, size_t size, size_t nmemb, std::string* userp);
-        static size_t fileWriteCallback(void* contents, size_t size, size_t nmemb, void* userp);
-        static int progressCallback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+        struct State;
+        std::shared_ptr<State> state_;
     };
 
 }
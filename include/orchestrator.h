@@ -43,6 +43,8 @@ private:
     ~Orchestrator();
 
     void worker(std::string arg);
+    void startPrefetch(const std::string& channel);
+    void prefetch(std::string channel);
     void setStatus(float p, const std::string& s);
     void setState(LauncherState s);
     void setError(const std::string& e);
@@ -54,6 +56,8 @@ private:
     std::string error_;
     
     std::thread workerThread_;
+    std::thread prefetchThread_;
+    std::atomic<bool> prefetching_{false};
     std::atomic<bool> stop_{false};
     std::atomic<bool> wineDebug_{false};
 };
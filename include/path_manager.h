@@ -20,6 +20,7 @@ public:
     std::filesystem::create_directories(root_);
     std::filesystem::create_directories(cache());
     std::filesystem::create_directories(versions());
+    std::filesystem::create_directories(store());
     std::filesystem::create_directories(prefix());
     std::filesystem::create_directories(wine());
     std::filesystem::create_directories(root_ / "umu_data");
@@ -29,6 +30,7 @@ public:
   std::filesystem::path root() const { return root_; }
   std::filesystem::path cache() const { return root_ / "cache"; }
   std::filesystem::path versions() const { return root_ / "versions"; }
+  std::filesystem::path store() const { return root_ / "store"; }
   std::filesystem::path prefix() const { return root_ / "prefix"; }
   std::filesystem::path wine() const { return root_ / "wine"; }
   std::filesystem::path umu() const { return root_ / "umu_data"; }
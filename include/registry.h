@@ -1,14 +1,24 @@
 #ifndef RSJFW_REGISTRY_H
 #define RSJFW_REGISTRY_H
 
+#include <atomic>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <memory>
+#include <memory_resource>
 #include <optional>
+#include <span>
 #include <variant>
 #include <shared_mutex>
+#include <thread>
+#include <mutex>
 #include <filesystem>
+#include <functional>
+
+struct stat;
 
 namespace rsjfw {
 
@@ -24,6 +34,28 @@ struct CaseInsensitiveLess {
     }
 };
 
+struct CaseInsensitiveHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const {
+        size_t h = 14695981039346656037ull;
+        for (unsigned char c : s) {
+            h ^= static_cast<size_t>(std::tolower(c));
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+};
+
+struct CaseInsensitiveEqual {
+    using is_transparent = void;
+    bool operator()(std::string_view a, std::string_view b) const {
+        return a.size() == b.size() &&
+               std::equal(a.begin(), a.end(), b.begin(), [](unsigned char c1, unsigned char c2) {
+                   return std::tolower(c1) == std::tolower(c2);
+               });
+    }
+};
+
 enum class RegistryType {
     None = 0,
     String = 1,
@@ -39,21 +71,64 @@ enum class RegistryType {
 };
 
 struct RegistryValue {
-    std::string name;
-    RegistryType type;
-    std::vector<uint8_t> data;
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    std::pmr::string name;
+    RegistryType type = RegistryType::String;
+    std::pmr::vector<uint8_t> data;
     uint32_t customType = 0;
 
+    RegistryValue() = default;
+    explicit RegistryValue(const allocator_type& a) : name(a), data(a) {}
+    RegistryValue(std::string_view n, RegistryType t, std::span<const uint8_t> d, uint32_t c = 0,
+                  const allocator_type& a = {})
+        : name(n, a), type(t), data(d.begin(), d.end(), a), customType(c) {}
+    RegistryValue(const RegistryValue& o, const allocator_type& a)
+        : name(o.name, a), type(o.type), data(o.data, a), customType(o.customType) {}
+    RegistryValue(RegistryValue&& o, const allocator_type& a)
+        : name(std::move(o.name), a), type(o.type), data(std::move(o.data), a), customType(o.customType) {}
+    RegistryValue(const RegistryValue&) = default;
+    RegistryValue(RegistryValue&&) = default;
+    RegistryValue& operator=(const RegistryValue&) = default;
+    RegistryValue& operator=(RegistryValue&&) = default;
+
     std::string asString() const;
     uint32_t asDword() const;
     std::vector<std::string> asMultiString() const;
 };
 
+struct HiveCacheReader;
+struct LazyHive;
+class HiveWatcher;
+
+// Identity of a hive file as last loaded or written. Rewriting in place
+// changes the size or mtime; renaming a new file over it changes the inode.
+struct HiveStamp {
+    uint64_t size = 0;
+    int64_t mtimeSec = 0;
+    int64_t mtimeNsec = 0;
+    uint64_t inode = 0;
+
+    HiveStamp() = default;
+    explicit HiveStamp(const struct ::stat& st);
+    bool operator==(const HiveStamp&) const = default;
+};
+
+// Keys, values and their strings are allocated from the allocator the key was
+// constructed with. A default-constructed key is a standalone heap-backed
+// tree; keys created by RegistryArena share the arena's buffers.
 class RegistryKey {
 public:
-    std::string name;
-    std::vector<RegistryValue> values;
-    std::vector<std::shared_ptr<RegistryKey>> subkeys;
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    // Children and values are indexed by case-folded name once a key grows
+    // past kIndexThreshold entries; mutate them through the methods below so
+    // the index stays in sync.
+    static constexpr size_t kIndexThreshold = 8;
+
+    std::pmr::string name;
+    std::pmr::vector<RegistryValue> values;
+    std::pmr::vector<RegistryKey*> subkeys;
     
     RegistryKey* parent = nullptr;
     uint64_t modified = 0;
@@ -61,59 +136,300 @@ public:
     uint32_t unixTime = 0;
     bool wasInFile = false;
 
-    RegistryKey() : wasInFile(false) {}
-    RegistryKey(const std::string& n, RegistryKey* p = nullptr) : name(n), parent(p), wasInFile(false) {}
+    RegistryKey() : RegistryKey(allocator_type{}) {}
+    explicit RegistryKey(const allocator_type& a) : RegistryKey({}, nullptr, a) {}
+    RegistryKey(std::string_view n, RegistryKey* p, const allocator_type& a = {})
+        : name(n, a), values(a), subkeys(a), parent(p), valueIndex_(a), subkeyIndex_(a) {}
+    ~RegistryKey();
 
-    RegistryValue* getValue(const std::string& name);
-    void setValue(const std::string& name, RegistryType type, const std::vector<uint8_t>& data, uint32_t customType = 0);
-    bool deleteValue(const std::string& name);
+    RegistryKey(const RegistryKey&) = delete;
+    RegistryKey& operator=(const RegistryKey&) = delete;
 
-    RegistryKey* add(const std::string& path);
-    RegistryKey* query(const std::string& path);
-    bool deleteKey(const std::string& path);
+    allocator_type get_allocator() const { return subkeys.get_allocator(); }
 
-    RegistryKey* queryPath(const std::string& path, bool create);
+    RegistryValue* getValue(std::string_view name);
+    const RegistryValue* getValue(std::string_view name) const;
+    void setValue(std::string_view name, RegistryType type, std::span<const uint8_t> data, uint32_t customType = 0);
+    bool deleteValue(std::string_view name);
+
+    RegistryKey* add(std::string_view path);
+    RegistryKey* query(std::string_view path);
+    bool deleteKey(std::string_view path);
+
+    RegistryKey* queryPath(std::string_view path, bool create);
     RegistryKey* root();
     void copyFrom(const RegistryKey& other);
+    // Makes this subtree equal to other, touching only what differs:
+    // subtrees with equal content hashes are skipped without a walk. Returns
+    // the number of keys and values inserted, updated or deleted.
+    size_t mergeFrom(const RegistryKey& other);
+    // Order-independent, case-folded hash of the subtree's names, values
+    // and key metadata.
+    uint64_t contentHash() const;
+
+    // A key is dirty once its values or children change after load; direct
+    // edits to the public fields are not tracked. dirtyCount() is kept on the
+    // root and counts every key dirtied since the tree was loaded or cleared.
+    bool isDirty() const { return dirty_; }
+    size_t dirtyCount() const { return dirtyKeys_; }
+    void clearDirty();
 
     bool load(std::istream& is);
+    bool load(std::string_view buf);
+    // Parses hive text that starts at a section header, i.e. load() without
+    // the leading version line. Sections merge into the existing tree.
+    bool loadSections(std::string_view buf);
     bool save(std::ostream& os, const std::string& rootPath);
+    // Appends the text of this subtree to out. Children are written in
+    // case-insensitive order; subkeys is sorted in place if it is not.
+    void save(std::string& out, const std::string& rootPath);
+    // Appends this key's own section (header and values) without children.
+    void saveSection(std::string& out, const std::string& path);
+    // Writes this subtree as regedit (REGEDIT5) text under keyPath, a full
+    // path such as "HKEY_CURRENT_USER\\Software". The text is passed to sink
+    // a few KiB at a time.
+    void exportReg(const std::string& keyPath, const std::function<void(std::string_view)>& sink);
+
+    // Compact binary image of this subtree, used for the on-disk hive cache.
+    void serialize(std::string& out) const;
+    bool deserialize(HiveCacheReader& in);
 
 private:
-    std::string unescape(const std::string& s);
-    std::string escape(const std::string& s);
-    std::string unquote(const std::string& s);
-    std::optional<RegistryValue> parseData(const std::string& value);
+    friend class Registry;
+    friend class RegistryArena;
+
+    using NameIndex = std::pmr::unordered_map<std::pmr::string, size_t, CaseInsensitiveHash, CaseInsensitiveEqual>;
+    using KeyIndex = std::pmr::unordered_map<std::string_view, RegistryKey*, CaseInsensitiveHash, CaseInsensitiveEqual>;
+    using HashMemo = std::unordered_map<const RegistryKey*, uint64_t>;
+
+    NameIndex valueIndex_;
+    KeyIndex subkeyIndex_;
+
+    bool dirty_ = false;
+    bool loading_ = false;
+    size_t dirtyKeys_ = 0;
+
+    void markDirty();
+    // loadSections() that, with track, dirties the keys it changes.
+    bool parseSections(std::string_view buf, bool track);
+    // Merges a tree parsed from a later part of the same hive. Children not
+    // present here are relinked, not copied, so other's storage must outlive
+    // this tree.
+    void absorb(RegistryKey& other);
+
+    RegistryKey* findChild(std::string_view name) const;
+    RegistryKey* addChild(std::string_view name);
+    void putValue(RegistryValue&& v);
+    void reindexValues();
+    void reindexSubkeys();
+    // Copies other's subtree into this empty key as is, dirty state
+    // included; used to detach a hive from a snapshot.
+    void cloneFrom(const RegistryKey& other);
+    static uint64_t hashTree(const RegistryKey& k, HashMemo& memo);
+    size_t mergeTree(const RegistryKey& other, const HashMemo& memo);
+
+    std::string unescape(std::string_view s);
+    std::string escape(std::string_view s);
+    std::string unquote(std::string_view s);
+    std::optional<RegistryValue> parseData(std::string_view value);
+    void saveTree(std::string& out, std::string& escapedPath);
+    void writeSection(std::string& out, std::string_view escapedPath);
+    void exportTree(std::string& path, std::string& out, const std::function<void(std::string_view)>& sink);
+};
+
+// Owns one hive. Every key, value, name and data buffer of the tree is bump
+// allocated from a single monotonic buffer, so loading a hive does no
+// per-node heap allocation and dropping the arena frees it in one step
+// without walking the tree. The flip side: deleted keys and replaced
+// values are never reclaimed, so an arena grows with every edit until it
+// is replaced. That happens whenever the hive is reloaded after an outside
+// change, and when a commit compacts a hive that has churned (see
+// Registry::saveHive).
+class RegistryArena {
+public:
+    explicit RegistryArena(size_t sizeHint = 0);
+    ~RegistryArena();
+
+    RegistryArena(const RegistryArena&) = delete;
+    RegistryArena& operator=(const RegistryArena&) = delete;
+
+    RegistryKey* root() { return root_; }
+    std::pmr::memory_resource* resource() { return &pool_; }
+
+    // Heap bytes the arena holds, part arenas included.
+    size_t footprint() const;
+    // Takes the current footprint as what the live tree needs; done right
+    // after a load or clone.
+    void settle() { baseline_ = footprint(); }
+    // Edits have at least doubled the footprint since settle(), so most of
+    // the arena is dead keys and values and a clone() would compact it.
+    bool churned() const;
+
+    // Parses a whole hive file into this arena. Large hives are split at
+    // section boundaries and parsed on several threads.
+    bool load(std::string_view buf);
+
+    // Deep copy of the tree, its dirty state and the lazy index. The copy
+    // shares the mapped hive file but no keys.
+    std::shared_ptr<RegistryArena> clone() const;
+    // Returns a handle to arena that keeps it pinned while any copy of the
+    // handle is alive. Registry copies a pinned hive before it changes in
+    // any way, including lazy parsing and the sorting and dirty reset of a
+    // commit, so the pinned tree never changes.
+    static std::shared_ptr<RegistryArena> pin(const std::shared_ptr<RegistryArena>& arena);
+    // The arena behind a handle from pin(), without adding a pin of its own.
+    static std::shared_ptr<RegistryArena> unpinned(const std::shared_ptr<RegistryArena>& handle);
+    bool pinned() const { return pins_.load(std::memory_order_acquire) > 0; }
+
+    // Set when the hive was opened lazily: the mapped file and the offsets of
+    // its sections, which are parsed into the tree only once touched.
+    std::unique_ptr<LazyHive> lazy;
+
+private:
+    // Counts what pool_ takes from the heap.
+    struct Upstream : std::pmr::memory_resource {
+        size_t bytes = 0;
+        void* do_allocate(size_t n, size_t align) override;
+        void do_deallocate(void* p, size_t n, size_t align) override;
+        bool do_is_equal(const memory_resource& o) const noexcept override { return this == &o; }
+    };
+
+    Upstream upstream_;
+    std::pmr::monotonic_buffer_resource pool_;
+    RegistryKey* root_;
+    size_t baseline_ = 0;
+    // Arenas of chunks parsed in parallel; their keys are linked into root_.
+    std::vector<std::unique_ptr<RegistryArena>> parts_;
+    std::atomic<unsigned> pins_{0};
+
+    struct Unpin;
 };
 
 class Registry {
 public:
-    Registry(const std::string& prefixDir);
+    // Lazy mode indexes section headers on load and parses a subtree the
+    // first time query/add/transplant reaches it. Sections that were never
+    // touched are written back verbatim on commit.
+    enum class LoadMode { Eager, Lazy };
+
+    // Point-in-time state of both hives. Taking one is O(1): the live
+    // arenas are pinned and shared, and the registry copies a hive only
+    // when it next writes to it. That first write copies the whole hive, so
+    // hold a snapshot only while a revert may actually follow. A snapshot may
+    // also be reverted into another Registry on the same prefix once the one
+    // it came from is gone.
+    struct Snapshot {
+        std::shared_ptr<RegistryArena> machine;
+        std::shared_ptr<RegistryArena> user;
+    };
+
+    // Batches edits under one hold of the registry lock: the hives are
+    // checked for outside changes once, each key path is resolved once, and
+    // commit() writes every touched hive in a single save. Edits are applied
+    // to the tree as they are made; dropping the transaction without
+    // commit() leaves them pending like add(). Other threads block until the
+    // transaction is gone; Registry calls and nested transactions on its own
+    // thread run under the same hold instead.
+    class Transaction {
+    public:
+        explicit Transaction(Registry& reg);
+        ~Transaction();
+
+        Transaction(const Transaction&) = delete;
+        Transaction& operator=(const Transaction&) = delete;
+
+        Transaction& setString(const std::string& path, std::string_view name, std::string_view value,
+                               RegistryType type = RegistryType::String);
+        Transaction& setDword(const std::string& path, std::string_view name, uint32_t value);
+        Transaction& setBinary(const std::string& path, std::string_view name, std::span<const uint8_t> data);
+        // Applies hive-format sections, as found in system.reg or user.reg
+        // after the version line, to the hive named by root ("HKLM" or
+        // "HKCU"). "[-key]" headers and "name"=- lines delete.
+        bool apply(const std::string& root, std::string_view sections);
+        bool commit();
+
+    private:
+        Registry& reg_;
+        // Unlocked when an outer transaction on this thread holds the lock.
+        std::unique_lock<std::shared_mutex> lock_;
+        std::unordered_map<std::string, RegistryKey*, CaseInsensitiveHash, CaseInsensitiveEqual> keys_;
+        // Registry::txnEpoch_ as of this transaction's last change; if it
+        // moved on, something else may have swapped a hive and keys_ is stale.
+        uint64_t epoch_ = 0;
+
+        RegistryKey* key(const std::string& path);
+        void invalidateIfStale();
+        void bumpEpoch();
+    };
+
+    Registry(const std::string& prefixDir, LoadMode mode = LoadMode::Eager);
     ~Registry();
 
     std::optional<std::string> query(const std::string& path, const std::string& valueName);
     void add(const std::string& path, const std::string& name, const std::string& val, const std::string& type = "REG_SZ");
-    void transplant(const std::string& path, Registry& source);
+    // Brings path in this registry in line with the same path in source.
+    // Returns the number of changes made; zero means there is nothing to
+    // commit.
+    size_t transplant(const std::string& path, Registry& source);
     bool commit();
+    size_t dirtyKeyCount() const;
+
+    // Streams the subtree at path to sink as regedit text, without the
+    // version line. Returns false if the key does not exist.
+    bool exportReg(const std::string& path, const std::function<void(std::string_view)>& sink);
+
+    Snapshot snapshot();
+    // Makes the snapshot the live state; the next commit() writes both
+    // hives back even if nothing else changed.
+    void revert(const Snapshot& snap);
     
-    std::shared_ptr<RegistryKey> getCurrentUser() { return currentUser_; }
+    std::shared_ptr<RegistryKey> getCurrentUser();
 
 private:
     std::string prefixDir_;
-    std::shared_ptr<RegistryKey> machine_;
-    std::shared_ptr<RegistryKey> currentUser_;
+    LoadMode mode_;
+    std::shared_ptr<RegistryArena> machine_;
+    std::shared_ptr<RegistryArena> currentUser_;
     mutable std::shared_mutex mutex_;
+    // Thread holding mutex_ through a Transaction, if any. Public calls made
+    // from it skip the lock (see Guard) and bump txnEpoch_ so the open
+    // transactions drop their cached key pointers.
+    std::atomic<std::thread::id> txnOwner_{};
+    mutable uint64_t txnEpoch_ = 0;
+    class Guard;
+    // Hive text is built here and written with a single write(); kept
+    // across commits so repeated saves do not reallocate.
+    std::string saveBuffer_;
     
-    std::filesystem::file_time_type lastSystem_;
-    std::filesystem::file_time_type lastUser_;
+    HiveStamp lastSystem_;
+    HiveStamp lastUser_;
+    // Hive generations last checked against the watcher; while they match,
+    // operations skip the stat of both hives.
+    std::shared_ptr<HiveWatcher> watcher_;
+    uint64_t seenSystem_ = 0;
+    uint64_t seenUser_ = 0;
+    // Set by revert(): the hive differs from the file although no key in it
+    // is dirty.
+    bool revertedSystem_ = false;
+    bool revertedUser_ = false;
 
     std::string systemRelativePath_ = "REGISTRY\\Machine";
     std::string userRelativePath_ = "REGISTRY\\User\\S-1-5-21-0-0-0-1000";
 
+    bool hivesChanged() const;
+    bool commitLocked();
+    bool applySections(const std::string& hive, std::string_view sections);
     void checkAndReload();
-    bool loadHive(const std::string& filename, std::shared_ptr<RegistryKey>& key);
-    bool saveHive(const std::string& filename, std::shared_ptr<RegistryKey>& key, const std::string& rootPath);
-    RegistryKey* getRoot(const std::string& path, std::string& subPath);
+    bool loadHive(const std::string& filename, std::shared_ptr<RegistryArena>& hive);
+    bool saveHive(const std::string& filename, std::shared_ptr<RegistryArena>& hive, const std::string& rootPath);
+    // With forWrite, a hive shared with a snapshot is copied first.
+    RegistryKey* getRoot(const std::string& path, std::string& subPath, bool forWrite = false);
+    void detach(std::shared_ptr<RegistryArena>& hive);
+    std::shared_ptr<RegistryArena>* hiveFor(const std::string& path);
+    void saveLazy(std::string& out, RegistryArena& hive);
+    // Copies a pinned hive before parsing into it, so callers must fetch
+    // the root again afterwards.
+    void materialize(std::shared_ptr<RegistryArena>& hive, const std::string& subPath, bool subtree);
 };
 
 } // namespace rsjfw
@@ -1,14 +1,28 @@
 #ifndef ZIP_UTIL_H
 #define ZIP_UTIL_H
 
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <vector>
 
 #include "common.h"
 
 namespace rsjfw {
     class ZipUtil {
     public:
-        static bool extract(const std::string& archivePath, const std::string& destPath, ProgressCallback cb = nullptr);
+        // Pulls the next block of archive bytes: returns its size, 0 at the
+        // end and -1 on error. The block must stay valid until the next call.
+        using BlockReader = std::function<long(const void** block)>;
+
+        // When files is given it receives the regular files written, relative
+        // to destPath.
+        static bool extract(const std::string& archivePath, const std::string& destPath, ProgressCallback cb = nullptr,
+                            std::vector<std::string>* files = nullptr);
+        // Extracts from a forward-only byte stream, e.g. a running download.
+        // totalBytes is only used for progress.
+        static bool extract(BlockReader reader, uint64_t totalBytes, const std::string& destPath, ProgressCallback cb = nullptr,
+                            std::vector<std::string>* files = nullptr);
     };
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,251 @@
+#include "cache_manager.h"
+#include "config.h"
+#include "content_store.h"
+#include "logger.h"
+#include "path_manager.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <unordered_map>
+#include <sys/stat.h>
+
+namespace rsjfw {
+
+namespace fs = std::filesystem;
+
+static const char *kLastUsedFile = ".rsjfw-last-used";
+
+// Partial downloads younger than this may still be written to.
+static const time_t kInFlightSeconds = 15 * 60;
+
+CacheManager &CacheManager::instance() {
+  static CacheManager inst;
+  return inst;
+}
+
+uintmax_t CacheManager::configuredBudget() {
+  int gb = Config::instance().getGeneral().diskBudgetGb;
+  return gb > 0 ? (uintmax_t)gb << 30 : 0;
+}
+
+std::string CacheManager::formatSize(uintmax_t bytes) {
+  char buf[32];
+  if (bytes >= (1ull << 30))
+    std::snprintf(buf, sizeof(buf), "%.1f GB", bytes / double(1ull << 30));
+  else if (bytes >= (1ull << 20))
+    std::snprintf(buf, sizeof(buf), "%.1f MB", bytes / double(1ull << 20));
+  else
+    std::snprintf(buf, sizeof(buf), "%.1f KB", bytes / 1024.0);
+  return buf;
+}
+
+void CacheManager::touchVersion(const std::string &guid) {
+  std::ofstream(PathManager::instance().versions() / guid / kLastUsedFile)
+      << std::time(nullptr);
+}
+
+// Size of a file or tree, and the newest access or modification in it.
+static uintmax_t measure(const fs::path &path, time_t &lastUsed) {
+  struct stat sb;
+  if (lstat(path.c_str(), &sb) != 0)
+    return 0;
+  lastUsed = std::max(sb.st_mtime, sb.st_atime);
+  if (!S_ISDIR(sb.st_mode))
+    return S_ISREG(sb.st_mode) ? sb.st_size : 0;
+
+  uintmax_t bytes = 0;
+  std::error_code ec;
+  for (auto it = fs::recursive_directory_iterator(path, ec);
+       it != fs::recursive_directory_iterator(); it.increment(ec)) {
+    if (ec)
+      break;
+    if (lstat(it->path().c_str(), &sb) != 0 || !S_ISREG(sb.st_mode))
+      continue;
+    bytes += sb.st_size;
+    lastUsed = std::max({lastUsed, sb.st_mtime, sb.st_atime});
+  }
+  return bytes;
+}
+
+static bool inFlight(const fs::path &path, time_t lastUsed, time_t now) {
+  static const char *suffixes[] = {".part", ".part.meta", ".stream", ".tmp"};
+  std::string name = path.filename().string();
+  for (const char *s : suffixes) {
+    std::string suffix = s;
+    if (name.size() > suffix.size() &&
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+      return now - lastUsed < kInFlightSeconds;
+  }
+  return false;
+}
+
+// Object names end in "-<size in hex>".
+static uintmax_t objectSize(const std::string &name) {
+  auto dash = name.rfind('-');
+  return dash == std::string::npos
+             ? 0
+             : std::strtoull(name.c_str() + dash + 1, nullptr, 16);
+}
+
+CacheManager::Usage CacheManager::scan(std::vector<Entry> *entries) {
+  auto &pm = PathManager::instance();
+  Usage usage;
+  time_t now = std::time(nullptr);
+  std::error_code ec;
+
+  auto scanFlat = [&](const fs::path &dir, uintmax_t &total) {
+    for (const auto &e : fs::directory_iterator(dir, ec)) {
+      Entry entry;
+      entry.path = e.path();
+      entry.bytes = measure(e.path(), entry.lastUsed);
+      total += entry.bytes;
+      // The verified-hash index is tiny and describes the rest.
+      if (entries && e.path().filename() != "verified.idx" &&
+          !inFlight(e.path(), entry.lastUsed, now))
+        entries->push_back(entry);
+    }
+  };
+  scanFlat(pm.cache(), usage.cache);
+  scanFlat(pm.root() / "downloads", usage.downloads);
+
+  for (auto it = fs::recursive_directory_iterator(pm.store(), ec);
+       it != fs::recursive_directory_iterator(); it.increment(ec)) {
+    if (ec)
+      break;
+    if (it->is_regular_file(ec))
+      usage.store += it->file_size(ec);
+  }
+
+  // Files a version shares through the store are counted once, under the
+  // store; evicting a version frees its own files plus the objects no
+  // other version references.
+  struct Version {
+    Entry entry;
+    std::vector<std::string> objects;
+    time_t installed = 0;
+    time_t launched = 0;
+  };
+  std::vector<Version> versions;
+  std::unordered_map<std::string, int> refCount;
+  for (const auto &v : fs::directory_iterator(pm.versions(), ec)) {
+    if (!v.is_directory(ec))
+      continue;
+    Version ver;
+    ver.entry.path = v.path();
+    ver.entry.version = true;
+    auto refs = ContentStore::instance().references(v.path());
+    for (const auto &[rel, object] : refs) {
+      ver.objects.push_back(object);
+      refCount[object]++;
+    }
+
+    time_t newest = 0;
+    struct stat sb;
+    for (auto it = fs::recursive_directory_iterator(v.path(), ec);
+         it != fs::recursive_directory_iterator(); it.increment(ec)) {
+      if (ec)
+        break;
+      if (lstat(it->path().c_str(), &sb) != 0 || !S_ISREG(sb.st_mode))
+        continue;
+      newest = std::max(newest, sb.st_mtime);
+      std::string rel = it->path().lexically_relative(v.path()).generic_string();
+      if (!refs.count(rel))
+        ver.entry.bytes += sb.st_size;
+    }
+    usage.versions += ver.entry.bytes;
+
+    if (stat((v.path() / "AppSettings.xml").c_str(), &sb) == 0) {
+      ver.installed = sb.st_mtime;
+      ver.entry.lastUsed = sb.st_mtime;
+      if (stat((v.path() / kLastUsedFile).c_str(), &sb) == 0) {
+        ver.launched = sb.st_mtime;
+        ver.entry.lastUsed = std::max(ver.entry.lastUsed, sb.st_mtime);
+      }
+    } else {
+      // Unfinished install; leave it alone while it may still be running.
+      ver.entry.lastUsed = newest;
+      if (now - newest < kInFlightSeconds)
+        continue;
+    }
+    versions.push_back(std::move(ver));
+  }
+  if (!entries)
+    return usage;
+
+  // Launches pick the newest install, and the last launched one may be
+  // running right now. Only the launch marker says which that is: a
+  // background install is newer on disk than the Studio it runs beside.
+  const Version *newest = nullptr, *active = nullptr;
+  for (const auto &v : versions) {
+    if (!v.installed)
+      continue;
+    if (!newest || v.installed > newest->installed)
+      newest = &v;
+    if (v.launched && (!active || v.launched > active->launched))
+      active = &v;
+  }
+  for (auto &v : versions) {
+    if (&v == newest || &v == active)
+      continue;
+    for (const auto &object : v.objects)
+      if (refCount[object] == 1)
+        v.entry.bytes += objectSize(object);
+    entries->push_back(v.entry);
+  }
+  return usage;
+}
+
+CacheManager::Usage CacheManager::usage() {
+  std::lock_guard<std::mutex> lk(mtx_);
+  return scan(nullptr);
+}
+
+CacheManager::Report CacheManager::collect(uintmax_t budget, bool dryRun) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  Report report;
+  std::vector<Entry> entries;
+  report.before = scan(&entries);
+  report.after = report.before;
+  uintmax_t total = report.before.total();
+  if (total <= budget)
+    return report;
+
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) {
+              return a.lastUsed < b.lastUsed;
+            });
+  bool prune = false;
+  for (const auto &e : entries) {
+    if (total <= budget)
+      break;
+    std::error_code ec;
+    if (!dryRun) {
+      fs::remove_all(e.path, ec);
+      if (ec) {
+        LOG_WARN("Could not evict %s: %s", e.path.c_str(),
+                 ec.message().c_str());
+        continue;
+      }
+    }
+    LOG_DEBUG("Evicting %s (%s)", e.path.c_str(), formatSize(e.bytes).c_str());
+    report.evicted.push_back(e.path.string());
+    total -= std::min(total, e.bytes);
+    prune |= e.version;
+  }
+
+  report.freed = report.before.total() - total;
+  if (dryRun)
+    return report;
+  if (prune)
+    ContentStore::instance().prune();
+  report.after = scan(nullptr);
+  if (report.after.total() < report.before.total())
+    report.freed = report.before.total() - report.after.total();
+  LOG_INFO("Disk cache collected: %s -> %s (budget %s), %zu entries evicted",
+           formatSize(report.before.total()).c_str(),
+           formatSize(report.after.total()).c_str(),
+           formatSize(budget).c_str(), report.evicted.size());
+  return report;
+}
+
+} // namespace rsjfw
@@ -56,6 +56,10 @@ nlohmann::json Config::serialize() const {
     j["general"]["selectedGpu"] = general_.selectedGpu;
     j["general"]["hideLauncher"] = general_.hideLauncher;
     j["general"]["autoApplyFixes"] = general_.autoApplyFixes;
+    j["general"]["keepPackageCache"] = general_.keepPackageCache;
+    j["general"]["prefetchUpdates"] = general_.prefetchUpdates;
+    j["general"]["prefetchRateKb"] = general_.prefetchRateKb;
+    j["general"]["diskBudgetGb"] = general_.diskBudgetGb;
     j["general"]["enableMangoHud"] = general_.enableMangoHud;
 
     j["general"]["enableFsync"] = general_.enableFsync;
@@ -123,6 +127,10 @@ void Config::deserialize(const nlohmann::json& j) {
         general_.selectedGpu = g.value("selectedGpu", "");
         general_.hideLauncher = g.value("hideLauncher", false);
         general_.autoApplyFixes = g.value("autoApplyFixes", true);
+        general_.keepPackageCache = g.value("keepPackageCache", false);
+        general_.prefetchUpdates = g.value("prefetchUpdates", true);
+        general_.prefetchRateKb = g.value("prefetchRateKb", 4096);
+        general_.diskBudgetGb = g.value("diskBudgetGb", 20);
         general_.enableMangoHud = g.value("enableMangoHud", false);
 
         general_.enableFsync = g.value("enableFsync", true);
@@ -0,0 +1,408 @@
+#include "content_store.h"
+#include "logger.h"
+#include "path_manager.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <unordered_set>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace rsjfw {
+
+namespace fs = std::filesystem;
+
+static const char *kRefsFile = ".rsjfw-objects";
+static const char *kTmpSuffix = ".rsjfw-tmp";
+
+// Exclusive flock on <store>/.lock, held by ingest and prune. An object
+// ingest has adopted is only listed in a refs file once ingest finishes,
+// so a prune in another thread or process must not sweep in between.
+class StoreLock {
+public:
+  explicit StoreLock(const fs::path &root) {
+    std::error_code ec;
+    fs::create_directories(root, ec);
+    fd_ = open((root / ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    while (fd_ >= 0 && flock(fd_, LOCK_EX) != 0 && errno == EINTR) {
+    }
+  }
+  ~StoreLock() {
+    if (fd_ >= 0)
+      close(fd_);
+  }
+  StoreLock(const StoreLock &) = delete;
+  StoreLock &operator=(const StoreLock &) = delete;
+
+private:
+  int fd_;
+};
+
+static bool writeFileAtomic(const fs::path &path, const std::string &data) {
+  fs::path tmp = path.string() + ".tmp";
+  {
+    std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+    ofs << data;
+    if (!ofs)
+      return false;
+  }
+  std::error_code ec;
+  fs::rename(tmp, path, ec);
+  return !ec;
+}
+
+// Streaming XXH64 with seed 0.
+class XXH64 {
+public:
+  void update(const uint8_t *p, size_t len) {
+    total_ += len;
+    if (buffered_ + len < 32) {
+      std::memcpy(buf_ + buffered_, p, len);
+      buffered_ += len;
+      return;
+    }
+    if (buffered_) {
+      size_t n = 32 - buffered_;
+      std::memcpy(buf_ + buffered_, p, n);
+      stripe(buf_);
+      p += n;
+      len -= n;
+      buffered_ = 0;
+    }
+    for (; len >= 32; p += 32, len -= 32)
+      stripe(p);
+    std::memcpy(buf_, p, len);
+    buffered_ = len;
+  }
+
+  uint64_t digest() const {
+    uint64_t h;
+    if (total_ >= 32) {
+      h = rotl(v_[0], 1) + rotl(v_[1], 7) + rotl(v_[2], 12) + rotl(v_[3], 18);
+      for (uint64_t v : v_)
+        h = (h ^ round(0, v)) * P1 + P4;
+    } else {
+      h = P5;
+    }
+    h += total_;
+    const uint8_t *p = buf_;
+    size_t len = buffered_;
+    for (; len >= 8; p += 8, len -= 8)
+      h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+    if (len >= 4) {
+      h = rotl(h ^ (uint64_t(read32(p)) * P1), 23) * P2 + P3;
+      p += 4;
+      len -= 4;
+    }
+    for (; len > 0; ++p, --len)
+      h = rotl(h ^ (*p * P5), 11) * P1;
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+  }
+
+private:
+  static constexpr uint64_t P1 = 11400714785074694791ULL;
+  static constexpr uint64_t P2 = 14029467366897019727ULL;
+  static constexpr uint64_t P3 = 1609587929392839161ULL;
+  static constexpr uint64_t P4 = 9650029242287828579ULL;
+  static constexpr uint64_t P5 = 2870177450012600261ULL;
+
+  static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+  static uint64_t round(uint64_t acc, uint64_t in) {
+    return rotl(acc + in * P2, 31) * P1;
+  }
+  static uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    return v;
+  }
+  static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+  }
+
+  void stripe(const uint8_t *p) {
+    for (int i = 0; i < 4; ++i)
+      v_[i] = round(v_[i], read64(p + i * 8));
+  }
+
+  uint64_t v_[4] = {P1 + P2, P2, 0, 0 - P1};
+  uint8_t buf_[32];
+  size_t buffered_ = 0;
+  uint64_t total_ = 0;
+};
+
+ContentStore &ContentStore::instance() {
+  static ContentStore inst;
+  return inst;
+}
+
+ContentStore::ContentStore() { root_ = PathManager::instance().store(); }
+
+uint64_t ContentStore::hashFile(const fs::path &path, bool &ok) {
+  ok = false;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  XXH64 h;
+  std::vector<uint8_t> buf(1 << 20);
+  ssize_t n;
+  while ((n = read(fd, buf.data(), buf.size())) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      close(fd);
+      return 0;
+    }
+    h.update(buf.data(), n);
+  }
+  close(fd);
+  ok = true;
+  return h.digest();
+}
+
+std::string ContentStore::objectName(uint64_t hash, uintmax_t size) {
+  char name[48];
+  std::snprintf(name, sizeof(name), "%016llx-%llx", (unsigned long long)hash,
+                (unsigned long long)size);
+  return name;
+}
+
+fs::path ContentStore::objectPath(const std::string &name) const {
+  return root_ / name.substr(0, 2) / name;
+}
+
+static bool reflink(const fs::path &from, const fs::path &to, mode_t mode) {
+  int src = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (src < 0)
+    return false;
+  int dst = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+  if (dst < 0) {
+    close(src);
+    return false;
+  }
+  bool ok = ioctl(dst, FICLONE, src) == 0;
+  int err = errno;
+  close(src);
+  close(dst);
+  if (!ok) {
+    unlink(to.c_str());
+    errno = err;
+  }
+  return ok;
+}
+
+// Every path hardlinked to an object shares its inode, so an in-place
+// write through one would change all versions and the object at once.
+// Read-only turns such a write into an error; replacing the file (write
+// elsewhere, rename over) still works.
+static void makeReadOnly(const fs::path &path) {
+  struct stat sb;
+  if (stat(path.c_str(), &sb) == 0 && (sb.st_mode & 0222))
+    chmod(path.c_str(), sb.st_mode & 07555);
+}
+
+// Links or clones source to a temporary name beside target and renames it
+// into place, so target is never observed missing or half-written.
+static bool placeLink(const fs::path &source, const fs::path &target,
+                      bool clone, mode_t mode) {
+  fs::path tmp = target.string() + kTmpSuffix;
+  unlink(tmp.c_str());
+  if (!clone)
+    makeReadOnly(source);
+  if (clone ? !reflink(source, tmp, mode) : link(source.c_str(), tmp.c_str()) != 0)
+    return false;
+  if (rename(tmp.c_str(), target.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool ContentStore::adopt(const fs::path &file, const fs::path &object) {
+  std::error_code ec;
+  fs::create_directories(object.parent_path(), ec);
+  struct stat sb;
+  if (stat(file.c_str(), &sb) != 0)
+    return false;
+
+  std::unique_lock<std::mutex> lk(probeMtx_, std::defer_lock);
+  if (mode_ == LinkMode::Unknown)
+    lk.lock();
+  if (mode_ == LinkMode::Unknown) {
+    // Probe once: reflinks keep each version's files independent, and
+    // hardlinks work on any filesystem that also holds the versions.
+    if (placeLink(file, object, true, sb.st_mode & 07777)) {
+      mode_ = LinkMode::Reflink;
+      LOG_DEBUG("Content store using reflinks at %s", root_.c_str());
+      return true;
+    }
+    if (placeLink(file, object, false, 0)) {
+      mode_ = LinkMode::Hardlink;
+      LOG_DEBUG("Content store using hardlinks at %s", root_.c_str());
+      return true;
+    }
+    LOG_WARN("Content store disabled, cannot link into %s: %s", root_.c_str(),
+             std::strerror(errno));
+    mode_ = LinkMode::None;
+    return false;
+  }
+  return placeLink(file, object, mode_ == LinkMode::Reflink,
+                   sb.st_mode & 07777);
+}
+
+bool ContentStore::linkInto(const fs::path &object, const fs::path &target) {
+  struct stat sb;
+  if (stat(target.c_str(), &sb) != 0)
+    return false;
+  return placeLink(object, target, mode_ == LinkMode::Reflink,
+                   sb.st_mode & 07777);
+}
+
+ContentStore::Stats
+ContentStore::ingest(const fs::path &dir, ProgressCallback cb,
+                     const std::unordered_map<std::string, std::string> *known,
+                     const std::atomic<bool> *cancel) {
+  Stats stats;
+  if (mode_ == LinkMode::None)
+    return stats;
+  StoreLock lock(root_);
+
+  std::vector<fs::path> files;
+  std::ostringstream refs;
+  std::error_code ec;
+  for (auto it = fs::recursive_directory_iterator(dir, ec);
+       it != fs::recursive_directory_iterator(); it.increment(ec)) {
+    if (ec)
+      break;
+    if (it->is_regular_file(ec) && !it->is_symlink(ec) &&
+        it->path().filename().string().rfind(".rsjfw-", 0) != 0)
+      files.push_back(it->path());
+  }
+
+  for (size_t i = 0; i < files.size() && mode_ != LinkMode::None; ++i) {
+    if (cancel && *cancel)
+      break;
+    const auto &file = files[i];
+    if (cb && i % 64 == 0)
+      cb((float)i / files.size(), file.filename().string());
+
+    struct stat sb;
+    // Empty files save nothing.
+    if (stat(file.c_str(), &sb) != 0 || sb.st_size == 0)
+      continue;
+
+    std::string rel = file.lexically_relative(dir).generic_string();
+    if (known) {
+      // Linked from an already ingested version; no need to hash again.
+      auto it = known->find(rel);
+      struct stat ob;
+      if (it != known->end() &&
+          stat(objectPath(it->second).c_str(), &ob) == 0 &&
+          ob.st_size == sb.st_size) {
+        refs << it->second << '\t' << rel << '\n';
+        stats.files++;
+        continue;
+      }
+    }
+
+    bool ok;
+    uint64_t hash = hashFile(file, ok);
+    if (!ok)
+      continue;
+    stats.files++;
+
+    std::string name = objectName(hash, sb.st_size);
+    fs::path object = objectPath(name);
+    struct stat ob;
+    if (stat(object.c_str(), &ob) == 0) {
+      if (ob.st_ino == sb.st_ino && ob.st_dev == sb.st_dev) {
+        refs << name << '\t' << rel << '\n';
+      } else if (linkInto(object, file)) {
+        refs << name << '\t' << rel << '\n';
+        stats.deduped++;
+        stats.bytesSaved += sb.st_size;
+      }
+    } else if (adopt(file, object)) {
+      refs << name << '\t' << rel << '\n';
+    }
+  }
+
+  if (mode_ != LinkMode::None)
+    writeFileAtomic(dir / kRefsFile, refs.str());
+  if (cb)
+    cb(1.0f, "complete");
+  return stats;
+}
+
+std::unordered_map<std::string, std::string>
+ContentStore::references(const fs::path &dir) {
+  std::unordered_map<std::string, std::string> refs;
+  std::ifstream ifs(dir / kRefsFile);
+  std::string line;
+  while (std::getline(ifs, line)) {
+    auto tab = line.find('\t');
+    if (tab != std::string::npos)
+      refs[line.substr(tab + 1)] = line.substr(0, tab);
+  }
+  return refs;
+}
+
+bool ContentStore::materialize(const fs::path &from, const fs::path &to) {
+  std::error_code ec;
+  fs::create_directories(to.parent_path(), ec);
+  struct stat sb;
+  if (stat(from.c_str(), &sb) != 0)
+    return false;
+  unlink(to.c_str());
+  if (mode_ != LinkMode::Hardlink && reflink(from, to, sb.st_mode & 07777))
+    return true;
+  makeReadOnly(from);
+  if (link(from.c_str(), to.c_str()) == 0)
+    return true;
+  return fs::copy_file(from, to, fs::copy_options::overwrite_existing, ec);
+}
+
+size_t ContentStore::prune() {
+  // Reflinked objects share no inode with the files cloned from them, so
+  // liveness comes from the reference list each ingested version keeps.
+  StoreLock lock(root_);
+  std::unordered_set<std::string> live;
+  std::error_code ec;
+  for (const auto &v : fs::directory_iterator(PathManager::instance().versions(), ec)) {
+    std::ifstream ifs(v.path() / kRefsFile);
+    std::string line;
+    while (std::getline(ifs, line))
+      live.insert(line.substr(0, line.find('\t')));
+  }
+
+  size_t removed = 0;
+  for (auto it = fs::recursive_directory_iterator(root_, ec);
+       it != fs::recursive_directory_iterator(); it.increment(ec)) {
+    if (ec)
+      break;
+    std::string name = it->path().filename().string();
+    // The lock file, and links placeLink has yet to rename into place.
+    if (!it->is_regular_file(ec) || live.count(name) || name[0] == '.' ||
+        name.find(kTmpSuffix) != std::string::npos)
+      continue;
+    if (unlink(it->path().c_str()) == 0)
+      removed++;
+  }
+  return removed;
+}
+
+} // namespace rsjfw
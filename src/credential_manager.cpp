@@ -59,11 +59,18 @@ void CredentialManager::syncAllRunners(std::shared_ptr<Prefix> activePrefix) {
       if (fs::exists(p) && absP != activePath &&
           fs::exists(fs::path(p) / "user.reg")) {
         LOG_DEBUG("Syncing credentials to prefix at %s", p.c_str());
-        Registry targetReg(p);
-        targetReg.transplant("HKCU\\Software\\Roblox\\RobloxStudio",
-                             activePrefix->getRegistry());
-        targetReg.transplant("HKCU\\Software\\Wine\\Credential Manager",
-                             activePrefix->getRegistry());
+        Registry targetReg(p, Registry::LoadMode::Lazy);
+        size_t changes =
+            targetReg.transplant("HKCU\\Software\\Roblox\\RobloxStudio",
+                                 activePrefix->getRegistry());
+        changes += targetReg.transplant(
+            "HKCU\\Software\\Wine\\Credential Manager",
+            activePrefix->getRegistry());
+        if (changes == 0) {
+          LOG_DEBUG("Prefix at %s already up to date", p.c_str());
+          continue;
+        }
+        LOG_DEBUG("Applied %zu registry changes to %s", changes, p.c_str());
         targetReg.commit();
       }
     }
@@ -93,12 +100,13 @@ void CredentialManager::syncAllRunners(std::shared_ptr<Prefix> activePrefix) {
     if (!bestPrefixPath.empty()) {
       LOG_INFO("Found existing session in %s, pulling to active runner...",
                bestPrefixPath.c_str());
-      Registry sourceReg(bestPrefixPath);
-      activePrefix->getRegistry().transplant(
+      Registry sourceReg(bestPrefixPath, Registry::LoadMode::Lazy);
+      size_t changes = activePrefix->getRegistry().transplant(
           "HKCU\\Software\\Roblox\\RobloxStudio", sourceReg);
-      activePrefix->getRegistry().transplant(
+      changes += activePrefix->getRegistry().transplant(
           "HKCU\\Software\\Wine\\Credential Manager", sourceReg);
-      activePrefix->registryCommit();
+      if (changes > 0)
+        activePrefix->registryCommit();
     } else {
       LOG_DEBUG("No active sessions found in any prefix.");
     }
@@ -0,0 +1,277 @@
+#include "download_engine.h"
+#include "logger.h"
+#include <algorithm>
+#include <future>
+
+namespace rsjfw
+{
+    DownloadEngine& DownloadEngine::instance()
+    {
+        static DownloadEngine inst;
+        return inst;
+    }
+
+    static thread_local DownloadEngine::Background* tlsBackground = nullptr;
+
+    DownloadEngine::BackgroundScope::BackgroundScope(Background* bg) : prev_(tlsBackground)
+    {
+        tlsBackground = bg;
+    }
+
+    DownloadEngine::BackgroundScope::~BackgroundScope()
+    {
+        tlsBackground = prev_;
+    }
+
+    DownloadEngine::Background* DownloadEngine::currentBackground()
+    {
+        return tlsBackground;
+    }
+
+    DownloadEngine::DownloadEngine()
+    {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+
+        // Only the event-loop thread ever touches handles attached to the
+        // share, so it needs no lock callbacks.
+        share_ = curl_share_init();
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+        multi_ = curl_multi_init();
+        curl_multi_setopt(multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS, 8L);
+        curl_multi_setopt(multi_, CURLMOPT_MAXCONNECTS, 16L);
+
+        loop_ = std::thread(&DownloadEngine::run, this);
+    }
+
+    DownloadEngine::~DownloadEngine()
+    {
+        stop_ = true;
+        curl_multi_wakeup(multi_);
+        if (loop_.joinable()) loop_.join();
+
+        for (auto* t : pending_) finish(t, CURLE_ABORTED_BY_CALLBACK);
+        pending_.clear();
+
+        curl_multi_cleanup(multi_);
+        curl_share_cleanup(share_);
+    }
+
+    size_t DownloadEngine::writeCallback(char* ptr, size_t size, size_t nmemb, void* userp)
+    {
+        auto* t = static_cast<Transfer*>(userp);
+        size_t total = size * nmemb;
+        if (!t->req.onData) return total;
+        return t->req.onData(ptr, total);
+    }
+
+    size_t DownloadEngine::headerCallback(char* ptr, size_t size, size_t nmemb, void* userp)
+    {
+        auto* t = static_cast<Transfer*>(userp);
+        size_t total = size * nmemb;
+        std::string_view line(ptr, total);
+        while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.remove_suffix(1);
+        t->req.onHeader(line);
+        return total;
+    }
+
+    int DownloadEngine::progressCallback(void* clientp, curl_off_t dltotal, curl_off_t dlnow,
+                                         curl_off_t, curl_off_t)
+    {
+        auto* t = static_cast<Transfer*>(clientp);
+        return t->req.onProgress(dltotal, dlnow) ? 0 : 1;
+    }
+
+    DownloadEngine::Id DownloadEngine::submit(Request req, DoneCallback onDone)
+    {
+        auto* t = new Transfer;
+        t->id = nextId_++;
+        t->req = std::move(req);
+        t->onDone = std::move(onDone);
+        t->bg = tlsBackground;
+        Id id = t->id;
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            pending_.push_back(t);
+        }
+        curl_multi_wakeup(multi_);
+        return id;
+    }
+
+    DownloadEngine::Result DownloadEngine::perform(Request req)
+    {
+        std::promise<Result> done;
+        auto fut = done.get_future();
+        submit(std::move(req), [&done](const Result& r) { done.set_value(r); });
+        return fut.get();
+    }
+
+    void DownloadEngine::cancel(Id id)
+    {
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            cancelled_.push_back(id);
+        }
+        curl_multi_wakeup(multi_);
+    }
+
+    void DownloadEngine::resume(Id id)
+    {
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            resumed_.push_back(id);
+        }
+        curl_multi_wakeup(multi_);
+    }
+
+    void DownloadEngine::start(Transfer* t)
+    {
+        if (t->bg && t->bg->cancel) {
+            finish(t, CURLE_ABORTED_BY_CALLBACK);
+            return;
+        }
+        CURL* easy = curl_easy_init();
+        if (!easy) {
+            finish(t, CURLE_FAILED_INIT);
+            return;
+        }
+        t->easy = easy;
+
+        curl_easy_setopt(easy, CURLOPT_URL, t->req.url.c_str());
+        curl_easy_setopt(easy, CURLOPT_SHARE, share_);
+        curl_easy_setopt(easy, CURLOPT_PRIVATE, t);
+        curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(easy, CURLOPT_USERAGENT, "RSJFW/1.1.0");
+        curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, t->req.connectTimeout);
+        if (t->req.multiplex) {
+            curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+            // Wait for an in-flight connection to the same host to settle so the
+            // transfer can join it as an HTTP/2 stream instead of dialing anew.
+            curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+        } else {
+            curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_1_1);
+        }
+        curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, writeCallback);
+        curl_easy_setopt(easy, CURLOPT_WRITEDATA, t);
+        if (t->req.headOnly) curl_easy_setopt(easy, CURLOPT_NOBODY, 1L);
+        if (!t->req.range.empty()) curl_easy_setopt(easy, CURLOPT_RANGE, t->req.range.c_str());
+        if (t->req.onHeader) {
+            curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, headerCallback);
+            curl_easy_setopt(easy, CURLOPT_HEADERDATA, t);
+        }
+
+        if (!t->req.headers.empty()) {
+            for (const auto& h : t->req.headers)
+                t->headers = curl_slist_append(t->headers, h.c_str());
+            curl_easy_setopt(easy, CURLOPT_HTTPHEADER, t->headers);
+        }
+
+        if (t->req.onProgress) {
+            curl_easy_setopt(easy, CURLOPT_NOPROGRESS, 0L);
+            curl_easy_setopt(easy, CURLOPT_XFERINFOFUNCTION, progressCallback);
+            curl_easy_setopt(easy, CURLOPT_XFERINFODATA, t);
+        }
+
+        CURLMcode mc = curl_multi_add_handle(multi_, easy);
+        if (mc != CURLM_OK) {
+            LOG_ERROR("curl_multi_add_handle failed: %s", curl_multi_strerror(mc));
+            finish(t, CURLE_FAILED_INIT);
+            return;
+        }
+        active_[t->id] = t;
+        if (t->bg) backgroundChanged_ = true;
+    }
+
+    void DownloadEngine::finish(Transfer* t, CURLcode code)
+    {
+        Result r;
+        r.code = code;
+        if (t->easy) {
+            curl_easy_getinfo(t->easy, CURLINFO_RESPONSE_CODE, &r.status);
+            curl_easy_getinfo(t->easy, CURLINFO_SIZE_DOWNLOAD_T, &r.bytes);
+            curl_easy_getinfo(t->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &r.contentLength);
+            char* effective = nullptr;
+            curl_easy_getinfo(t->easy, CURLINFO_EFFECTIVE_URL, &effective);
+            if (effective) r.effectiveUrl = effective;
+            curl_multi_remove_handle(multi_, t->easy);
+            curl_easy_cleanup(t->easy);
+        }
+        if (t->bg) backgroundChanged_ = true;
+        curl_slist_free_all(t->headers);
+        if (t->onDone) t->onDone(r);
+        delete t;
+    }
+
+    // Re-divides each Background's cap between its running transfers.
+    void DownloadEngine::throttleBackground()
+    {
+        std::unordered_map<Background*, curl_off_t> running;
+        for (auto& [id, t] : active_)
+            if (t->bg) running[t->bg]++;
+        for (auto& [id, t] : active_) {
+            if (!t->bg || t->bg->maxBytesPerSec <= 0) continue;
+            curl_off_t share = std::max<curl_off_t>(t->bg->maxBytesPerSec / running[t->bg], 1024);
+            curl_easy_setopt(t->easy, CURLOPT_MAX_RECV_SPEED_LARGE, share);
+        }
+    }
+
+    void DownloadEngine::run()
+    {
+        while (!stop_) {
+            std::vector<Transfer*> incoming;
+            std::vector<Id> cancelled, resumed;
+            {
+                std::lock_guard<std::mutex> lk(mtx_);
+                incoming.swap(pending_);
+                cancelled.swap(cancelled_);
+                resumed.swap(resumed_);
+            }
+            for (auto* t : incoming) start(t);
+            for (Id id : cancelled) {
+                auto it = active_.find(id);
+                if (it == active_.end()) continue;
+                Transfer* t = it->second;
+                active_.erase(it);
+                finish(t, CURLE_ABORTED_BY_CALLBACK);
+            }
+            for (Id id : resumed) {
+                auto it = active_.find(id);
+                if (it != active_.end()) curl_easy_pause(it->second->easy, CURLPAUSE_CONT);
+            }
+            for (auto it = active_.begin(); it != active_.end();) {
+                Transfer* t = it->second;
+                if (t->bg && t->bg->cancel) {
+                    it = active_.erase(it);
+                    finish(t, CURLE_ABORTED_BY_CALLBACK);
+                } else {
+                    ++it;
+                }
+            }
+            if (backgroundChanged_) {
+                backgroundChanged_ = false;
+                throttleBackground();
+            }
+
+            int running = 0;
+            curl_multi_perform(multi_, &running);
+
+            CURLMsg* msg;
+            int left = 0;
+            while ((msg = curl_multi_info_read(multi_, &left))) {
+                if (msg->msg != CURLMSG_DONE) continue;
+                Transfer* t = nullptr;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &t);
+                CURLcode code = msg->data.result;
+                active_.erase(t->id);
+                finish(t, code);
+            }
+
+            curl_multi_poll(multi_, nullptr, 0, 1000, nullptr);
+        }
+
+        for (auto& [id, t] : active_) finish(t, CURLE_ABORTED_BY_CALLBACK);
+        active_.clear();
+    }
+}
@@ -2,12 +2,21 @@
 #include "path_manager.h"
 #include "http.h"
 #include "zip_util.h"
+#include "config.h"
+#include "content_store.h"
+#include "download_engine.h"
+#include "md5.h"
 #include "logger.h"
 #include <fstream>
 #include <unordered_map>
 #include <thread>
 #include <iostream>
 #include <queue>
+#include <deque>
+#include <chrono>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
@@ -42,7 +51,9 @@ std::vector<std::string> RobloxManager::getInstalledVersions() {
     std::vector<std::string> vers;
     if (!fs::exists(versionsDir_)) return vers;
     for (const auto& entry : fs::directory_iterator(versionsDir_)) {
-        if (entry.is_directory() && fs::exists(entry.path() / "AppSettings.xml")) {
+        // Dot-directories are background installs still being staged.
+        if (entry.is_directory() && entry.path().filename().string()[0] != '.' &&
+            fs::exists(entry.path() / "AppSettings.xml")) {
             vers.push_back(entry.path().filename().string());
         }
     }
@@ -53,6 +64,8 @@ bool RobloxManager::deleteVersion(const std::string& guid) {
     fs::path p = versionsDir_ / guid;
     if (fs::exists(p)) {
         fs::remove_all(p);
+        size_t pruned = ContentStore::instance().prune();
+        if (pruned) LOG_DEBUG("Pruned %zu unreferenced store objects", pruned);
         return true;
     }
     return false;
@@ -99,23 +112,164 @@ bool RobloxManager::downloadPackage(const std::string& guid, const RobloxPackage
     std::string url = "https://setup.rbxcdn.com/" + guid + "-" + pkg.name;
     fs::path cachePath = pm.cache() / (guid + "_" + pkg.name);
 
+    if (fs::exists(cachePath) && !verifyCached(cachePath, pkg.checksum)) {
+        LOG_WARN("Cached %s does not match its checksum, redownloading", pkg.name.c_str());
+        fs::remove(cachePath);
+    }
+
     if (!fs::exists(cachePath)) {
-        if (!HTTP::download(url, cachePath.string(), cb)) {
+        if (!HTTP::download(url, cachePath.string(), cb, pkg.checksum, (long long)pkg.packedSize)) {
             fs::remove(cachePath);
             return false;
         }
+        markVerified(cachePath, pkg.checksum);
     } else if (cb) {
         cb(1.0f, "0.0 B/s");
     }
     return true;
 }
 
-bool RobloxManager::extractPackage(const std::string& guid, const RobloxPackage& pkg, const std::string& targetDir, rsjfw::ProgressCallback cb) {
+bool RobloxManager::extractPackage(const std::string& guid, const RobloxPackage& pkg, const std::string& targetDir, rsjfw::ProgressCallback cb, std::vector<std::string>* files) {
+    auto& pm = PathManager::instance();
+    fs::path cachePath = pm.cache() / (guid + "_" + pkg.name);
+    std::string sub = getDestinationSubfolder(pkg.name);
+    fs::path destSub = fs::path(targetDir) / sub;
+    fs::create_directories(destSub);
+    bool ok = ZipUtil::extract(cachePath.string(), destSub.string(), cb, files);
+    if (files)
+        for (auto& f : *files) f = sub + f;
+    if (ok && !Config::instance().getGeneral().keepPackageCache) {
+        std::error_code ec;
+        fs::remove(cachePath, ec);
+    }
+    return ok;
+}
+
+bool RobloxManager::isPackageCached(const std::string& guid, const RobloxPackage& pkg) {
+    return fs::exists(PathManager::instance().cache() / (guid + "_" + pkg.name));
+}
+
+bool RobloxManager::streamPackage(const std::string& guid, const RobloxPackage& pkg, const std::string& targetDir, rsjfw::ProgressCallback downloadCb, rsjfw::ProgressCallback extractCb, std::vector<std::string>* files) {
     auto& pm = PathManager::instance();
+    std::string url = "https://setup.rbxcdn.com/" + guid + "-" + pkg.name;
     fs::path cachePath = pm.cache() / (guid + "_" + pkg.name);
-    fs::path destSub = fs::path(targetDir) / getDestinationSubfolder(pkg.name);
+    fs::path partPath = cachePath.string() + ".stream";
+    std::string sub = getDestinationSubfolder(pkg.name);
+    fs::path destSub = fs::path(targetDir) / sub;
     fs::create_directories(destSub);
-    return ZipUtil::extract(cachePath.string(), destSub.string(), cb);
+
+    std::ofstream cache;
+    if (Config::instance().getGeneral().keepPackageCache)
+        cache.open(partPath, std::ios::binary | std::ios::trunc);
+    MD5 md5;
+    HTTPStream::Tap tap = [&](const char* data, size_t len) {
+        md5.update(data, len);
+        if (!cache.is_open()) return true;
+        cache.write(data, len);
+        return (bool)cache;
+    };
+
+    bool extracted;
+    long tail = -1;
+    {
+        HTTPStream stream(url, downloadCb, tap);
+        extracted = ZipUtil::extract([&stream](const void** block) { return stream.read(block); },
+                                     pkg.packedSize, destSub.string(), extractCb, files);
+        // The zip reader stops at the central directory; drain the rest so
+        // the transfer completes and the cache copy is whole. After a
+        // failure the stream's destructor cancels the transfer instead.
+        if (extracted) {
+            const void* block;
+            while ((tail = stream.read(&block)) > 0) {}
+        }
+    }
+
+    bool ok = extracted && tail == 0;
+    if (files)
+        for (auto& f : *files) f = sub + f;
+    if (ok && !pkg.checksum.empty() && !HTTP::checksumMatches(md5.hexDigest(), pkg.checksum)) {
+        LOG_WARN("Checksum mismatch for %s", pkg.name.c_str());
+        ok = false;
+    }
+
+    if (cache.is_open()) {
+        cache.close();
+        std::error_code ec;
+        if (ok && !cache.fail()) {
+            fs::rename(partPath, cachePath, ec);
+            if (!ec) markVerified(cachePath, pkg.checksum);
+        } else {
+            fs::remove(partPath, ec);
+        }
+    }
+    return ok;
+}
+
+// Index of cache files whose checksum has been verified, keyed by file name
+// and invalidated by size or mtime changes, so a cache hit does not rehash.
+void RobloxManager::loadVerifiedIndex() {
+    if (indexLoaded_) return;
+    indexLoaded_ = true;
+    std::ifstream ifs(PathManager::instance().cache() / "verified.idx");
+    std::string line;
+    while (std::getline(ifs, line)) {
+        std::istringstream ss(line);
+        std::string name;
+        VerifiedEntry e;
+        if (std::getline(ss, name, '\t') && ss >> e.checksum >> e.size >> e.mtime)
+            verified_[name] = e;
+    }
+}
+
+static bool statFile(const fs::path& path, uintmax_t& size, long long& mtime) {
+    std::error_code ec;
+    size = fs::file_size(path, ec);
+    if (ec) return false;
+    auto t = fs::last_write_time(path, ec);
+    if (ec) return false;
+    mtime = t.time_since_epoch().count();
+    return true;
+}
+
+bool RobloxManager::verifyCached(const fs::path& path, const std::string& checksum) {
+    if (checksum.empty()) return true;
+    uintmax_t size;
+    long long mtime;
+    if (!statFile(path, size, mtime)) return false;
+    {
+        std::lock_guard<std::mutex> lk(indexMtx_);
+        loadVerifiedIndex();
+        auto it = verified_.find(path.filename().string());
+        if (it != verified_.end() && it->second.size == size && it->second.mtime == mtime &&
+            HTTP::checksumMatches(it->second.checksum, checksum))
+            return true;
+    }
+    if (!HTTP::checksumMatches(MD5::hashFile(path.string()), checksum)) return false;
+    markVerified(path, checksum);
+    return true;
+}
+
+void RobloxManager::markVerified(const fs::path& path, const std::string& checksum) {
+    if (checksum.empty()) return;
+    VerifiedEntry e{checksum};
+    if (!statFile(path, e.size, e.mtime)) return;
+
+    std::lock_guard<std::mutex> lk(indexMtx_);
+    loadVerifiedIndex();
+    verified_[path.filename().string()] = e;
+
+    fs::path idx = PathManager::instance().cache() / "verified.idx";
+    fs::path tmp = idx.string() + ".tmp";
+    {
+        std::ofstream ofs(tmp, std::ios::trunc);
+        for (const auto& [name, v] : verified_) {
+            if (!fs::exists(path.parent_path() / name)) continue;
+            ofs << name << '\t' << v.checksum << ' ' << v.size << ' ' << v.mtime << '\n';
+        }
+        if (!ofs) return;
+    }
+    std::error_code ec;
+    fs::rename(tmp, idx, ec);
 }
 
 struct ThreadInfo {
@@ -125,18 +279,63 @@ struct ThreadInfo {
     bool isExtracting = false;
 };
 
+// A Stream task downloads and extracts in one pass, so it holds both a
+// download and an extraction slot.
+enum class TaskKind { Download, Stream, Extract };
+
+// Hill-climbs the number of concurrent downloads: one more slot while the
+// aggregate throughput keeps improving by 10%, one back once it stops.
+struct DownloadGovernor {
+    int limit = 2;
+    int maxLimit = 12;
+    double bestThroughput = 0;
+    bool growing = true;
+    std::chrono::steady_clock::time_point lastAdjust = std::chrono::steady_clock::now();
+
+    void sample(double throughput, int active) {
+        auto now = std::chrono::steady_clock::now();
+        // Only a saturated pool says anything about the link.
+        if (!growing || active < limit || now - lastAdjust < std::chrono::seconds(2)) return;
+        lastAdjust = now;
+        if (throughput > bestThroughput * 1.1) {
+            bestThroughput = throughput;
+            if (limit < maxLimit) limit++;
+            else growing = false;
+        } else {
+            growing = false;
+            if (limit > 2) limit--;
+        }
+    }
+};
+
 struct TaskState {
     std::mutex mtx;
     std::condition_variable cv;
-    std::queue<RobloxPackage> downloadQueue;
-    std::queue<RobloxPackage> extractQueue;
+    // Both kept largest-first so the longest package never starts last.
+    std::deque<RobloxPackage> downloadQueue;
+    std::deque<RobloxPackage> extractQueue;
     std::atomic<int> completedPackages{0};
     int totalPackages = 0;
     int activeDownloads = 0;
+    int peakDownloads = 0;
+    int activeExtracts = 0;
+    int extractLimit = 1;
+    DownloadGovernor governor;
     bool failed = false;
+    // Set when installing in the background; workers carry it over.
+    DownloadEngine::Background* background = nullptr;
     std::map<std::thread::id, ThreadInfo> activeThreads;
+    std::map<std::string, std::vector<std::string>> packageFiles;
+    // Summed busy time per task kind, for the install report.
+    double downloadSeconds = 0;
+    double extractSeconds = 0;
 };
 
+static void pushLargestFirst(std::deque<RobloxPackage>& q, const RobloxPackage& pkg) {
+    auto it = std::find_if(q.begin(), q.end(), [&](const RobloxPackage& p) { return p.packedSize < pkg.packedSize; });
+    q.insert(it, pkg);
+}
+
 static double parseSpeed(const std::string& speedStr) {
     std::stringstream ss(speedStr);
     double val;
@@ -188,34 +387,70 @@ static void updateMainProgress(std::shared_ptr<TaskState> state, rsjfw::Progress
     mainCb(p, ss.str());
 }
 
-static void workerLoop(std::shared_ptr<TaskState> state, int type, std::string guid, std::string targetDir, RobloxManager* mgr, rsjfw::ProgressCallback mainCb) {
+// Any idle worker takes whichever kind of work is ready: queued
+// extractions first, since they only need the disk, then downloads while
+// the governor allows another one in flight. A download streams straight
+// into the version only when an extraction slot is free as well;
+// otherwise it lands in the cache and queues its extraction, so
+// extractLimit bounds every writer to the version directory.
+static bool nextTask(TaskState& state, std::unique_lock<std::mutex>& lk, RobloxPackage& pkg, TaskKind& kind) {
+    while (true) {
+        if (state.failed || state.completedPackages >= state.totalPackages) return false;
+        if (state.background && state.background->cancel) {
+            state.failed = true;
+            return false;
+        }
+        double throughput = 0;
+        for (const auto& [tid, info] : state.activeThreads)
+            if (!info.isExtracting) throughput += info.speedBytes;
+        state.governor.sample(throughput, state.activeDownloads);
+
+        if (!state.extractQueue.empty() && state.activeExtracts < state.extractLimit) {
+            pkg = state.extractQueue.front();
+            state.extractQueue.pop_front();
+            state.activeExtracts++;
+            kind = TaskKind::Extract;
+            return true;
+        }
+        if (!state.downloadQueue.empty() && state.activeDownloads < state.governor.limit) {
+            pkg = state.downloadQueue.front();
+            state.downloadQueue.pop_front();
+            state.activeDownloads++;
+            state.peakDownloads = std::max(state.peakDownloads, state.activeDownloads);
+            kind = TaskKind::Download;
+            if (state.activeExtracts < state.extractLimit) {
+                state.activeExtracts++;
+                kind = TaskKind::Stream;
+            }
+            return true;
+        }
+        if (state.downloadQueue.empty() && state.extractQueue.empty() && state.activeDownloads == 0 &&
+            state.activeExtracts == 0)
+            return false;
+        // Time out now and then so a raised download limit is picked up.
+        state.cv.wait_for(lk, std::chrono::milliseconds(500));
+    }
+}
+
+static void workerLoop(std::shared_ptr<TaskState> state, std::string guid, std::string targetDir, RobloxManager* mgr, rsjfw::ProgressCallback mainCb) {
+    DownloadEngine::BackgroundScope scope(state->background);
     auto tid = std::this_thread::get_id();
     while (true) {
         RobloxPackage pkg;
-        bool isDownload = (type == 0);
+        TaskKind kind;
         {
             std::unique_lock<std::mutex> lk(state->mtx);
-            if (state->failed || state->completedPackages >= state->totalPackages) return;
-            if (isDownload) {
-                if (state->downloadQueue.empty()) return;
-                pkg = state->downloadQueue.front();
-                state->downloadQueue.pop();
-            state->activeDownloads++;
-            state->activeThreads[tid] = {pkg.name, "", 0, false};
-        } else {
-            state->cv.wait(lk, [&] {
-                    return !state->extractQueue.empty() || state->failed || state->completedPackages >= state->totalPackages ||
-                           (state->downloadQueue.empty() && state->activeDownloads == 0);
-                });
-                if (state->failed || state->completedPackages >= state->totalPackages || (state->extractQueue.empty() && state->downloadQueue.empty() && state->activeDownloads == 0))
-                    return;
-                if (state->extractQueue.empty()) continue;
-            pkg = state->extractQueue.front();
-            state->extractQueue.pop();
-            state->activeThreads[tid] = {pkg.name, "", 0, true};
+            if (!nextTask(*state, lk, pkg, kind)) {
+                state->cv.notify_all();
+                return;
+            }
+            state->activeThreads[tid] = {pkg.name, "", 0, kind == TaskKind::Extract};
         }
-    }
-    bool ok = false;
+        bool isDownload = kind != TaskKind::Extract;
+        auto started = std::chrono::steady_clock::now();
+        bool ok = false;
+        bool streamed = false;
+        std::vector<std::string> files;
         if (isDownload) {
             auto subCb = [&](float, std::string speedStr) {
                 {
@@ -224,35 +459,56 @@ static void workerLoop(std::shared_ptr<TaskState> state, int type, std::string g
                 }
                 updateMainProgress(state, mainCb);
             };
-            ok = mgr->downloadPackage(guid, pkg, targetDir, subCb);
+            auto exCb = [&](float, std::string s) {
+                {
+                    std::lock_guard<std::mutex> lk(state->mtx);
+                    state->activeThreads[tid].currentFile = s.find("extracting ") == 0 ? s.substr(11) : s;
+                }
+                updateMainProgress(state, mainCb);
+            };
+            bool stopped = false;
+            if (kind == TaskKind::Stream && !mgr->isPackageCached(guid, pkg)) {
+                streamed = mgr->streamPackage(guid, pkg, targetDir, subCb, exCb, &files);
+                if (!streamed) {
+                    // A stream cut short by cancel or another package's
+                    // failure is not worth a second transfer.
+                    std::lock_guard<std::mutex> lk(state->mtx);
+                    stopped = state->failed || (state->background && state->background->cancel);
+                }
+                if (!streamed && !stopped)
+                    LOG_WARN("Streaming %s failed, retrying as a cached download", pkg.name.c_str());
+            }
+            ok = streamed || (!stopped && mgr->downloadPackage(guid, pkg, targetDir, subCb));
         } else {
             auto subCb = [&](float, std::string s) {
                 {
                     std::lock_guard<std::mutex> lk(state->mtx);
-                    // s format is "extracting: filename"
-                    if (s.find("extracting: ") == 0) {
-                        state->activeThreads[tid].currentFile = s.substr(12);
-                    } else {
-                        state->activeThreads[tid].currentFile = s;
-                    }
+                    state->activeThreads[tid].currentFile = s.find("extracting ") == 0 ? s.substr(11) : s;
                 }
                 updateMainProgress(state, mainCb);
             };
-            ok = mgr->extractPackage(guid, pkg, targetDir, subCb);
+            ok = mgr->extractPackage(guid, pkg, targetDir, subCb, &files);
         }
+        double busy = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
         {
             std::unique_lock<std::mutex> lk(state->mtx);
             state->activeThreads.erase(tid);
+            if (isDownload) {
+                state->activeDownloads--;
+                state->downloadSeconds += busy;
+            }
+            if (kind != TaskKind::Download) state->activeExtracts--;
+            if (kind == TaskKind::Extract) state->extractSeconds += busy;
             if (!ok) {
                 state->failed = true;
                 state->cv.notify_all();
                 return;
             }
-            if (isDownload) {
-                state->activeDownloads--;
-                state->extractQueue.push(pkg);
+            if (isDownload && !streamed) {
+                pushLargestFirst(state->extractQueue, pkg);
             } else {
                 state->completedPackages++;
+                state->packageFiles[pkg.name] = std::move(files);
             }
             state->cv.notify_all();
         }
@@ -260,31 +516,181 @@ static void workerLoop(std::shared_ptr<TaskState> state, int type, std::string g
     }
 }
 
+// Spinning disks seek themselves to death under parallel extraction.
+static bool onRotationalDisk(const fs::path& path) {
+    struct stat sb;
+    if (stat(path.c_str(), &sb) != 0) return false;
+    std::string dev = "/sys/dev/block/" + std::to_string(major(sb.st_dev)) + ":" + std::to_string(minor(sb.st_dev));
+    for (const char* rel : {"/queue/rotational", "/../queue/rotational"}) {
+        std::ifstream ifs(dev + rel);
+        int rotational;
+        if (ifs >> rotational) return rotational == 1;
+    }
+    return false;
+}
+
+static const char* kPackageIndex = ".rsjfw-packages";
+
+void RobloxManager::writePackageIndex(const fs::path& dir, const std::vector<RobloxPackage>& pkgs,
+                                      const std::map<std::string, std::vector<std::string>>& files) {
+    std::ofstream ofs(dir / kPackageIndex, std::ios::trunc);
+    for (const auto& p : pkgs) {
+        auto it = files.find(p.name);
+        if (it == files.end() || p.checksum.empty()) continue;
+        ofs << "package\t" << p.name << "\t" << p.checksum << "\n";
+        for (const auto& f : it->second) ofs << "file\t" << f << "\n";
+    }
+}
+
+std::unordered_map<std::string, RobloxManager::InstalledPackage> RobloxManager::findInstalledPackages(const std::string& exclude) {
+    std::unordered_map<std::string, InstalledPackage> found;
+    for (const auto& guid : getInstalledVersions()) {
+        if (guid == exclude) continue;
+        fs::path dir = versionsDir_ / guid;
+        std::ifstream ifs(dir / kPackageIndex);
+        std::string line;
+        InstalledPackage* cur = nullptr;
+        while (std::getline(ifs, line)) {
+            if (line.rfind("package\t", 0) == 0) {
+                std::string key = line.substr(8);
+                cur = found.count(key) ? nullptr : &found[key];
+                if (cur) cur->dir = dir;
+            } else if (cur && line.rfind("file\t", 0) == 0) {
+                cur->files.push_back(line.substr(5));
+            }
+        }
+    }
+    return found;
+}
+
+bool RobloxManager::reusePackage(const fs::path& from, const fs::path& to, const std::vector<std::string>& files) {
+    auto& store = ContentStore::instance();
+    for (const auto& f : files) {
+        if (!store.materialize(from / f, to / f)) {
+            LOG_WARN("Could not reuse %s from %s", f.c_str(), from.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
 bool RobloxManager::installVersion(const std::string& guid, rsjfw::ProgressCallback cb) {
     if (isInstalled(guid)) {
         if (cb) cb(1.0f, "Version already installed");
         return true;
     }
     try {
+        using Clock = std::chrono::steady_clock;
+        auto seconds = [](Clock::time_point a, Clock::time_point b) { return std::chrono::duration<double>(b - a).count(); };
+        auto tStart = Clock::now();
         if (cb) cb(0.0f, "fetching manifest...");
         auto pkgs = RobloxAPI::getPackageManifest(guid);
+        // Longest processing time first: the biggest package dominates the
+        // tail if it starts last.
         std::sort(pkgs.begin(), pkgs.end(), [](const RobloxPackage& a, const RobloxPackage& b) {
-            return a.packedSize < b.packedSize;
+            return a.packedSize > b.packedSize;
         });
-        size_t total = pkgs.size();
-        fs::path targetDir = versionsDir_ / guid;
-        fs::create_directories(targetDir);
+        auto tManifest = Clock::now();
+        fs::path finalDir = versionsDir_ / guid;
+        fs::path targetDir = finalDir;
         auto state = std::make_shared<TaskState>();
-        state->totalPackages = total;
-        for (const auto& p : pkgs) state->downloadQueue.push(p);
+        state->background = DownloadEngine::currentBackground();
+        if (state->background) {
+            // Built in a directory only this process writes to and renamed
+            // into place once complete, so a cancel can throw it away
+            // without touching a version someone else is installing.
+            targetDir = versionsDir_ / ("." + guid + ".partial-" + std::to_string(getpid()));
+            std::error_code ec;
+            fs::remove_all(targetDir, ec);
+        }
+        fs::create_directories(targetDir);
+
+        // Packages whose checksum matches one an installed version already
+        // extracted are linked over from it instead of fetched.
+        auto donors = findInstalledPackages(guid);
+        std::map<fs::path, std::unordered_map<std::string, std::string>> donorRefs;
+        std::unordered_map<std::string, std::string> known;
+        size_t reused = 0;
+        for (const auto& p : pkgs) {
+            auto it = donors.find(p.name + "\t" + p.checksum);
+            if (!p.checksum.empty() && it != donors.end() && reusePackage(it->second.dir, targetDir, it->second.files)) {
+                auto refs = donorRefs.find(it->second.dir);
+                if (refs == donorRefs.end())
+                    refs = donorRefs.emplace(it->second.dir, ContentStore::instance().references(it->second.dir)).first;
+                for (const auto& f : it->second.files) {
+                    auto r = refs->second.find(f);
+                    if (r != refs->second.end()) known[f] = r->second;
+                }
+                state->packageFiles[p.name] = it->second.files;
+                reused++;
+                continue;
+            }
+            state->downloadQueue.push_back(p);
+        }
+        state->totalPackages = state->downloadQueue.size();
+        auto tReuse = Clock::now();
+        if (reused) LOG_INFO("Reusing %zu of %zu packages from installed versions", reused, pkgs.size());
+        if (cb && reused) cb(0.0f, "reused " + std::to_string(reused) + " unchanged packages");
+        unsigned hw = std::thread::hardware_concurrency();
+        state->extractLimit = std::clamp<int>(hw ? hw : 2, 1, 8);
+        if (onRotationalDisk(targetDir)) {
+            state->extractLimit = 1;
+            state->governor.maxLimit = 4;
+        }
+        if (state->background) {
+            // Stay out of the way of whatever the foreground is doing.
+            state->extractLimit = 1;
+            state->governor.maxLimit = 2;
+        }
+        int workers = std::min(state->totalPackages, state->governor.maxLimit + state->extractLimit);
+        LOG_DEBUG("Installing %d packages with up to %d workers (%d extracting)", state->totalPackages, workers,
+                  state->extractLimit);
         std::vector<std::thread> threads;
-        for (int i = 0; i < 4; ++i) threads.emplace_back(workerLoop, state, 0, guid, targetDir.string(), this, cb);
-        for (int i = 0; i < 3; ++i) threads.emplace_back(workerLoop, state, 1, guid, targetDir.string(), this, cb);
+        for (int i = 0; i < workers; ++i) threads.emplace_back(workerLoop, state, guid, targetDir.string(), this, cb);
         for (auto& t : threads) t.join();
-        if (state->failed) return false;
+        auto* bg = state->background;
+        // A failed or cancelled background install has nothing to resume
+        // from (the next one extracts every package again).
+        auto discardStaging = [&] {
+            std::error_code ec;
+            if (targetDir != finalDir) fs::remove_all(targetDir, ec);
+        };
+        if (state->failed) {
+            discardStaging();
+            return false;
+        }
+        auto tPackages = Clock::now();
+        writePackageIndex(targetDir, pkgs, state->packageFiles);
+        // Cut short by cancel, ingest leaves the rest as plain files; the
+        // version is complete either way.
+        auto stats = ContentStore::instance().ingest(targetDir, makeSubProgress(0.0f, 1.0f, "deduplicating", cb), &known,
+                                                     bg ? &bg->cancel : nullptr);
+        LOG_INFO("Linked %zu of %zu files to existing store objects (%.1f MB shared)", stats.deduped, stats.files,
+                 stats.bytesSaved / (1024.0 * 1024.0));
+        auto tDone = Clock::now();
+        LOG_INFO("Installed %s in %.1fs: manifest %.1fs, reuse %.1fs, packages %.1fs (download %.1fs, extract %.1fs busy, "
+                 "peak %d downloads), dedup %.1fs",
+                 guid.c_str(), seconds(tStart, tDone), seconds(tStart, tManifest), seconds(tManifest, tReuse),
+                 seconds(tReuse, tPackages), state->downloadSeconds, state->extractSeconds, state->peakDownloads,
+                 seconds(tPackages, tDone));
         fs::path settingsPath = targetDir / "AppSettings.xml";
-        std::ofstream ofs(settingsPath);
-        ofs << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n<Settings>\r\n\t<ContentFolder>content</ContentFolder>\r\n\t<BaseUrl>http://www.roblox.com</BaseUrl>\r\n</Settings>\r\n";
+        {
+            std::ofstream ofs(settingsPath);
+            ofs << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n<Settings>\r\n\t<ContentFolder>content</ContentFolder>\r\n\t<BaseUrl>http://www.roblox.com</BaseUrl>\r\n</Settings>\r\n";
+        }
+        if (targetDir != finalDir) {
+            // Fails when another installer created the version meanwhile;
+            // theirs wins.
+            std::error_code ec;
+            fs::rename(targetDir, finalDir, ec);
+            if (ec) {
+                discardStaging();
+                if (!isInstalled(guid)) {
+                    LOG_WARN("Could not move %s into place: %s", guid.c_str(), ec.message().c_str());
+                    return false;
+                }
+            }
+        }
         if (cb) cb(1.0f, "Complete");
         return true;
     } catch (const std::exception& e) {
@@ -180,6 +180,21 @@ void GeneralView::render() {
     ImGui::Checkbox("enable dxvk translation", &gen.dxvk);
     ImGui::Checkbox("hide launcher ui", &gen.hideLauncher);
     ImGui::Checkbox("auto-apply fixes", &gen.autoApplyFixes);
+    ImGui::Checkbox("keep package cache", &gen.keepPackageCache);
+    if (ImGui::IsItemHovered()) ImGui::SetTooltip("keep downloaded studio packages for offline reinstall");
+    ImGui::Checkbox("prefetch updates", &gen.prefetchUpdates);
+    if (ImGui::IsItemHovered()) ImGui::SetTooltip("install new studio versions in the background while studio runs");
+    if (gen.prefetchUpdates) {
+        ImGui::SameLine(180);
+        ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x - 10);
+        ImGui::SliderInt("##PrefetchRate", &gen.prefetchRateKb, 0, 65536,
+                         gen.prefetchRateKb == 0 ? "unlimited" : "%d KB/s");
+    }
+    ImGui::Text("disk budget");
+    if (ImGui::IsItemHovered()) ImGui::SetTooltip("least recently used versions and downloads are removed past this size");
+    ImGui::SameLine(180);
+    ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x - 10);
+    ImGui::SliderInt("##DiskBudget", &gen.diskBudgetGb, 0, 200, gen.diskBudgetGb == 0 ? "unlimited" : "%d GB");
 
     ImGui::Dummy(ImVec2(0, 20));
     ImGui::Text("performance & compatibility (wrappers)");
@@ -6,6 +6,7 @@
 #include "http.h"
 #include "async_image_loader.h"
 #include <imgui.h>
+#include <algorithm>
 #include <filesystem>
 #include <thread>
 
@@ -30,6 +31,23 @@ void HomeView::refreshUsers() {
     }).detach();
 }
 
+void HomeView::refreshUsage(bool collect) {
+    if (scanning_) return;
+    scanning_ = true;
+
+    std::thread([this, collect]() {
+        auto& cm = CacheManager::instance();
+        uintmax_t budget = CacheManager::configuredBudget();
+        auto usage = collect && budget ? cm.collect(budget).after : cm.usage();
+        {
+            std::lock_guard<std::mutex> lock(usageMtx_);
+            usage_ = usage;
+            usageLoaded_ = true;
+        }
+        scanning_ = false;
+    }).detach();
+}
+
 void HomeView::render() {
     float winWidth = ImGui::GetContentRegionAvail().x;
     
@@ -96,6 +114,47 @@ void HomeView::render() {
         ImGui::EndTable();
     }
     
+    ImGui::Dummy(ImVec2(0, 20));
+    ImGui::Text("disk usage");
+    ImGui::Separator();
+    ImGui::Dummy(ImVec2(0, 10));
+
+    {
+        CacheManager::Usage usage;
+        bool loaded;
+        {
+            std::lock_guard<std::mutex> lock(usageMtx_);
+            usage = usage_;
+            loaded = usageLoaded_;
+        }
+        if (!loaded) {
+            if (!scanning_) refreshUsage();
+            ImGui::TextColored(ImVec4(1, 1, 0, 1), "measuring...");
+        } else {
+            uintmax_t budget = CacheManager::configuredBudget();
+            std::string total = CacheManager::formatSize(usage.total());
+            if (budget) {
+                std::string overlay = total + " of " + CacheManager::formatSize(budget);
+                float frac = std::min(1.0f, (float)((double)usage.total() / (double)budget));
+                ImGui::ProgressBar(frac, ImVec2(-1, 0), overlay.c_str());
+            } else {
+                ImGui::Text("%s (no budget)", total.c_str());
+            }
+            ImGui::TextDisabled("cache %s  versions %s  store %s  downloads %s",
+                                CacheManager::formatSize(usage.cache).c_str(),
+                                CacheManager::formatSize(usage.versions).c_str(),
+                                CacheManager::formatSize(usage.store).c_str(),
+                                CacheManager::formatSize(usage.downloads).c_str());
+            if (scanning_) {
+                ImGui::TextColored(ImVec4(1, 1, 0, 1), "working...");
+            } else {
+                if (budget && ImGui::Button("free space now")) refreshUsage(true);
+                if (budget) ImGui::SameLine();
+                if (ImGui::Button("refresh usage")) refreshUsage();
+            }
+        }
+    }
+
     ImGui::Dummy(ImVec2(0, 20));
     ImGui::Text("logged in accounts");
     ImGui::Separator();
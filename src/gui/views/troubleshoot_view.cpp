@@ -4,6 +4,7 @@
 #include "downloader/roblox_manager.h"
 #include "path_manager.h"
 #include "runner.h"
+#include "runner_manager.h"
 #include <filesystem>
 #include <imgui.h>
 
@@ -14,6 +15,12 @@ namespace fs = std::filesystem;
 void TroubleshootView::render() {
   auto &gen = Config::instance().getGeneral();
 
+  // A checkpoint taken on another prefix can't be reverted into this one.
+  auto active = RunnerManager::instance().get();
+  if (baseline_ &&
+      (!active || active->getPrefix()->getPath() != baselinePrefix_))
+    baseline_.reset();
+
   ImGui::Text("maintenance & repair");
   ImGui::TextColored(ImVec4(0.9f, 0.4f, 0.0f, 1.0f),
                      "warning: destructive actions ahead.");
@@ -103,6 +110,45 @@ void TroubleshootView::render() {
     runner->getPrefix()->wine("regedit", {});
   }
 
+  ImGui::Dummy(ImVec2(0, 5));
+
+  // The snapshot is only taken here: while it is held, the next write to
+  // each hive has to copy all of it.
+  if (ImGui::Button("checkpoint prefix registry", ImVec2(w, h)) && active) {
+    baselinePrefix_ = active->getPrefix()->getPath();
+    baseline_ = active->getPrefix()->getRegistry().snapshot();
+  }
+
+  ImGui::Dummy(ImVec2(0, 5));
+
+  if (!baseline_)
+    ImGui::BeginDisabled();
+  if (ImGui::Button("revert prefix registry", ImVec2(w, h))) {
+    ImGui::OpenPopup("Confirm Registry Revert");
+  }
+  if (!baseline_)
+    ImGui::EndDisabled();
+
+  if (ImGui::BeginPopupModal("Confirm Registry Revert", NULL,
+                             ImGuiWindowFlags_AlwaysAutoResize)) {
+    ImGui::Text("this restores system.reg and user.reg to how they were at");
+    ImGui::Text("the last checkpoint. close studio before proceeding.");
+
+    if (ImGui::Button("proceed", ImVec2(120, 0))) {
+      if (active && baseline_) {
+        auto &reg = active->getPrefix()->getRegistry();
+        reg.revert(*baseline_);
+        reg.commit();
+        baseline_.reset();
+      }
+      ImGui::CloseCurrentPopup();
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("cancel", ImVec2(120, 0)))
+      ImGui::CloseCurrentPopup();
+    ImGui::EndPopup();
+  }
+
   ImGui::Dummy(ImVec2(0, 50));
 }
 
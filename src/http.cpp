@@ -1,6 +1,7 @@
 #include "http.h"
+#include "download_engine.h"
 #include "logger.h"
-#include <curl/curl.h>
+#include "md5.h"
 #include <fstream>
 #include <filesystem>
 #include <iostream>
@@ -9,26 +10,22 @@
 #include <thread>
 #include <iomanip>
 #include <sstream>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string_view>
+#include <cctype>
+#include <fcntl.h>
+#include <optional>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace rsjfw
 {
     namespace fs = std::filesystem;
 
-    size_t HTTP::fileWriteCallback(void* contents, size_t size, size_t nmemb, void* userp)
-    {
-        auto* ofs = static_cast<std::ofstream*>(userp);
-        size_t total = size * nmemb;
-        ofs->write(static_cast<char*>(contents), total);
-        return total;
-    }
-
-    size_t HTTP::writeCallback(void* contents, size_t size, size_t nmemb, std::string* userp)
-    {
-        size_t total = size * nmemb;
-        userp->append((char*)contents, total);
-        return total;
-    }
-
     struct ProgData
     {
         ProgressCallback cb;
@@ -39,9 +36,8 @@ namespace rsjfw
         bool aborted = false;
     };
 
-    int HTTP::progressCallback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+    static bool reportProgress(ProgData* data, curl_off_t dltotal, curl_off_t dlnow)
     {
-        auto* data = static_cast<ProgData*>(clientp);
         auto now = std::chrono::steady_clock::now();
         auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - data->lastTime).count();
 
@@ -61,7 +57,7 @@ namespace rsjfw
 
             if (data->stalledTime >= 30000.0) {
                 data->aborted = true;
-                return 1;
+                return false;
             }
 
             if (data->cb && dltotal > 0)
@@ -78,78 +74,528 @@ namespace rsjfw
                 data->cb(prog, ss.str());
             }
         }
-        return 0;
+        return true;
     }
 
     std::string HTTP::get(const std::string& url)
     {
-        CURL* curl = curl_easy_init();
-        if (!curl) throw std::runtime_error("CURL init failed");
         std::string resp;
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resp);
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-        curl_easy_setopt(curl, CURLOPT_USERAGENT, "RSJFW/1.1.0");
-        CURLcode res = curl_easy_perform(curl);
-        curl_easy_cleanup(curl);
-        if (res != CURLE_OK) throw std::runtime_error("CURL GET failed: " + url);
+        DownloadEngine::Request req;
+        req.url = url;
+        req.onData = [&resp](const char* data, size_t len) {
+            resp.append(data, len);
+            return len;
+        };
+        auto res = DownloadEngine::instance().perform(std::move(req));
+        if (!res.ok()) throw std::runtime_error("CURL GET failed: " + url);
         return resp;
     }
 
+    // Below this size a single multiplexed stream is already as fast as
+    // splitting; above it each segment gets its own connection.
+    static constexpr curl_off_t kSegmentThreshold = 32LL << 20;
+    static constexpr curl_off_t kMinSegmentSize = 16LL << 20;
+    static constexpr int kMaxSegments = 8;
+
+    struct RemoteInfo
+    {
+        std::string url;
+        curl_off_t size = -1;
+        bool ranges = false;
+        // Strong ETag, else Last-Modified; empty when the resource has
+        // neither and a partial file cannot be trusted.
+        std::string validator;
+        // False when nothing was asked up front; the GET's own headers
+        // then fill in ranges and validator.
+        bool probed = false;
+    };
+
+    struct Segment
+    {
+        curl_off_t begin = 0, length = 0, done = 0;
+    };
+
+    // Sidecar next to a .part file describing what it holds, so a later
+    // attempt (or a later run) can resume it with If-Range.
+    struct PartState
+    {
+        std::string validator;
+        curl_off_t size = -1;
+        std::vector<Segment> segs;
+    };
+
+    static bool headerIs(std::string_view line, std::string_view name)
+    {
+        if (line.size() <= name.size() || line[name.size()] != ':') return false;
+        for (size_t i = 0; i < name.size(); ++i)
+            if (std::tolower((unsigned char)line[i]) != std::tolower((unsigned char)name[i])) return false;
+        return true;
+    }
+
+    static std::string_view headerValue(std::string_view line)
+    {
+        line.remove_prefix(line.find(':') + 1);
+        while (!line.empty() && line.front() == ' ') line.remove_prefix(1);
+        return line;
+    }
+
+    static long statusOf(std::string_view line)
+    {
+        if (line.rfind("HTTP/", 0) != 0) return 0;
+        size_t sp = line.find(' ');
+        return sp == std::string_view::npos ? 0 : std::atol(std::string(line.substr(sp + 1, 3)).c_str());
+    }
+
+    // Picks what resuming needs out of a response's headers.
+    struct ResumeHeaders
+    {
+        long status = 0;
+        bool ranges = false;
+        std::string etag, modified;
+
+        void onLine(std::string_view line)
+        {
+            // Headers of every redirect hop arrive here; only the last counts.
+            if (long code = statusOf(line)) {
+                status = code;
+                ranges = false;
+                etag.clear();
+                modified.clear();
+            } else if (headerIs(line, "Accept-Ranges")) {
+                ranges = headerValue(line) == "bytes";
+            } else if (headerIs(line, "ETag")) {
+                // If-Range only accepts strong validators.
+                auto v = headerValue(line);
+                if (v.rfind("W/", 0) != 0) etag = v;
+            } else if (headerIs(line, "Last-Modified")) {
+                modified = headerValue(line);
+            }
+        }
+        std::string validator() const { return !etag.empty() ? etag : modified; }
+    };
+
+    static RemoteInfo probe(const std::string& url)
+    {
+        RemoteInfo info;
+        ResumeHeaders headers;
+        DownloadEngine::Request req;
+        req.url = url;
+        req.headOnly = true;
+        req.onHeader = [&](std::string_view line) { headers.onLine(line); };
+        auto res = DownloadEngine::instance().perform(std::move(req));
+        if (!res.ok()) return {};
+        info.url = res.effectiveUrl.empty() ? url : res.effectiveUrl;
+        info.size = res.contentLength;
+        info.ranges = headers.ranges;
+        info.validator = headers.validator();
+        info.probed = true;
+        return info;
+    }
+
+    static fs::path metaPath(const fs::path& partPath)
+    {
+        return partPath.string() + ".meta";
+    }
+
+    static std::optional<PartState> loadPartState(const fs::path& partPath)
+    {
+        std::ifstream ifs(metaPath(partPath));
+        if (!ifs || !fs::exists(partPath)) return std::nullopt;
+        PartState st;
+        std::string line;
+        while (std::getline(ifs, line)) {
+            auto eq = line.find('=');
+            if (eq == std::string::npos) continue;
+            std::string key = line.substr(0, eq), val = line.substr(eq + 1);
+            if (key == "validator") st.validator = val;
+            else if (key == "size") st.size = std::atoll(val.c_str());
+            else if (key == "segment") {
+                Segment seg;
+                if (std::sscanf(val.c_str(), "%lld %lld %lld", (long long*)&seg.begin, (long long*)&seg.length,
+                                (long long*)&seg.done) != 3)
+                    return std::nullopt;
+                st.segs.push_back(seg);
+            }
+        }
+        if (st.validator.empty()) return std::nullopt;
+        return st;
+    }
+
+    static void savePartState(const fs::path& partPath, const PartState& st)
+    {
+        fs::path meta = metaPath(partPath);
+        fs::path tmp = meta.string() + ".tmp";
+        {
+            std::ofstream ofs(tmp, std::ios::trunc);
+            ofs << "validator=" << st.validator << "\n";
+            ofs << "size=" << st.size << "\n";
+            for (const auto& seg : st.segs)
+                ofs << "segment=" << seg.begin << " " << seg.length << " " << seg.done << "\n";
+            if (!ofs) return;
+        }
+        std::error_code ec;
+        fs::rename(tmp, meta, ec);
+    }
+
+    static void clearPartState(const fs::path& partPath)
+    {
+        std::error_code ec;
+        fs::remove(metaPath(partPath), ec);
+    }
+
+    static bool writeAll(int fd, const char* data, size_t len, off_t offset)
+    {
+        while (len > 0) {
+            ssize_t n = pwrite(fd, data, len, offset);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += n;
+            len -= n;
+            offset += n;
+        }
+        return true;
+    }
+
+    // Feeds bytes already on disk into the hash, for resumed transfers.
+    static bool hashRange(int fd, MD5& md5, curl_off_t from, curl_off_t to)
+    {
+        char buf[1 << 16];
+        while (from < to) {
+            ssize_t n = pread(fd, buf, std::min<curl_off_t>(sizeof(buf), to - from), from);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            md5.update(buf, n);
+            from += n;
+        }
+        return true;
+    }
+
+    // Appends to an existing .part when it was written against the same
+    // validator; the If-Range header makes the server send the full body
+    // instead of a 206 if the resource changed since. Without a probe the
+    // sidecar's validator is taken on trust, If-Range keeps that safe, and
+    // info learns the real one from the response for the next attempt.
+    static DownloadEngine::Result downloadStream(const std::string& url, RemoteInfo& info,
+                                                 const fs::path& partPath, ProgData& pd, MD5* md5)
+    {
+        DownloadEngine::Result res;
+        int fd = open(partPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            LOG_ERROR("Failed to open file for writing: %s", partPath.c_str());
+            res.code = CURLE_WRITE_ERROR;
+            return res;
+        }
+
+        curl_off_t offset = 0;
+        auto state = loadPartState(partPath);
+        if (!info.probed && info.validator.empty() && state && state->segs.empty()) {
+            info.validator = state->validator;
+            info.ranges = true;
+        }
+        struct stat sb;
+        if (info.ranges && state && state->segs.empty() && state->validator == info.validator &&
+            fstat(fd, &sb) == 0)
+            offset = sb.st_size;
+        if (info.size >= 0 && offset > info.size) offset = 0;
+        if (md5 && offset > 0 && !hashRange(fd, *md5, 0, offset)) offset = 0;
+        if (offset > 0 && offset == info.size) {
+            close(fd);
+            return res;
+        }
+        if (offset == 0) {
+            if (ftruncate(fd, 0) != 0) {
+                close(fd);
+                res.code = CURLE_WRITE_ERROR;
+                return res;
+            }
+            if (!info.validator.empty()) savePartState(partPath, {info.validator, info.size, {}});
+            else clearPartState(partPath);
+        } else {
+            LOG_INFO("Resuming %s at %lld bytes", url.c_str(), (long long)offset);
+        }
+
+        ResumeHeaders headers;
+        const long& status = headers.status;
+        curl_off_t base = offset, pos = offset;
+        bool first = true;
+        DownloadEngine::Request req;
+        req.url = url;
+        if (offset > 0) {
+            req.range = std::to_string(offset) + "-";
+            req.headers.push_back("If-Range: " + info.validator);
+        }
+        req.onHeader = [&headers](std::string_view line) { headers.onLine(line); };
+        req.onData = [&](const char* data, size_t len) -> size_t {
+            if (first) {
+                first = false;
+                // Anything but the body itself (an error page, a 206 we did
+                // not ask for) must never reach the .part.
+                if (status != 200 && (status != 206 || pos == 0)) return 0;
+                if (status == 200 && pos > 0) {
+                    LOG_INFO("%s changed on the server, restarting download", url.c_str());
+                    if (ftruncate(fd, 0) != 0) return 0;
+                    base = pos = 0;
+                    if (md5) md5->reset();
+                }
+            }
+            if (!writeAll(fd, data, len, pos)) return 0;
+            if (md5) md5->update(data, len);
+            pos += len;
+            return len;
+        };
+        if (pd.cb) {
+            req.onProgress = [&](curl_off_t total, curl_off_t now) {
+                return reportProgress(&pd, total > 0 ? total + base : 0, now + base);
+            };
+        }
+
+        res = DownloadEngine::instance().perform(std::move(req));
+        close(fd);
+        if (!info.probed && (status == 200 || status == 206)) {
+            // A 206 leaves Accept-Ranges out at times; it still proves them.
+            info.ranges = headers.ranges || status == 206;
+            info.validator = headers.validator();
+            if (!info.validator.empty()) savePartState(partPath, {info.validator, info.size, {}});
+            else clearPartState(partPath);
+        }
+        return res;
+    }
+
+    // Fetches [begin, end] slices concurrently and pwrite()s them into a
+    // preallocated file. The engine's loop thread only writes and counts;
+    // reading back for the hash and syncing for checkpoints happen on the
+    // calling thread, which would otherwise just wait, so a slow disk
+    // never stalls the other transfers. mtx guards everything shared.
+    static DownloadEngine::Result downloadSegmented(const RemoteInfo& info, const fs::path& partPath, ProgData& pd,
+                                                    MD5* md5)
+    {
+        DownloadEngine::Result res;
+        auto state = loadPartState(partPath);
+        bool resume = !info.validator.empty() && state && !state->segs.empty() &&
+                      state->validator == info.validator && state->size == info.size;
+
+        int fd = open(partPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0644);
+        if (fd < 0) {
+            LOG_ERROR("Failed to open file for writing: %s", partPath.c_str());
+            res.code = CURLE_WRITE_ERROR;
+            return res;
+        }
+
+        PartState st;
+        if (resume) {
+            st = std::move(*state);
+            LOG_INFO("Resuming %s from %zu segments", info.url.c_str(), st.segs.size());
+        } else {
+            if (posix_fallocate(fd, 0, info.size) != 0 && ftruncate(fd, info.size) != 0) {
+                LOG_ERROR("Failed to preallocate %s", partPath.c_str());
+                close(fd);
+                res.code = CURLE_WRITE_ERROR;
+                return res;
+            }
+            int count = (int)std::clamp<curl_off_t>(info.size / kMinSegmentSize, 2, kMaxSegments);
+            curl_off_t step = (info.size + count - 1) / count;
+            st.validator = info.validator;
+            st.size = info.size;
+            for (curl_off_t b = 0; b < info.size; b += step)
+                st.segs.push_back({b, std::min(step, info.size - b)});
+        }
+        auto& segs = st.segs;
+        // Data must be on disk before the sidecar claims it is.
+        auto checkpoint = [&](const PartState& snapshot) {
+            if (snapshot.validator.empty()) return;
+            if (fdatasync(fd) == 0) savePartState(partPath, snapshot);
+        };
+        checkpoint(st);
+
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::vector<DownloadEngine::Result> results(segs.size());
+        std::vector<long> statuses(segs.size());
+        size_t remaining = segs.size();
+        curl_off_t received = 0;
+        for (const auto& seg : segs) received += seg.done;
+        bool failed = false;
+
+        // MD5 needs the bytes in order: the leading segment is hashed as it
+        // arrives, later ones are read back from the page cache once the
+        // hashed prefix reaches them. catchingUp keeps the two apart.
+        curl_off_t hashed = 0;
+        bool catchingUp = false;
+
+        for (size_t i = 0; i < segs.size(); ++i) {
+            const Segment& seg = segs[i];
+            if (seg.done >= seg.length) {
+                results[i].status = 206;
+                --remaining;
+                continue;
+            }
+            DownloadEngine::Request req;
+            req.url = info.url;
+            req.range = std::to_string(seg.begin + seg.done) + "-" + std::to_string(seg.begin + seg.length - 1);
+            if (seg.done > 0) req.headers.push_back("If-Range: " + st.validator);
+            req.multiplex = false;
+            req.onHeader = [&statuses, i](std::string_view line) {
+                if (long code = statusOf(line)) statuses[i] = code;
+            };
+            req.onData = [&, fd, i](const char* data, size_t len) -> size_t {
+                Segment& seg = segs[i];
+                std::lock_guard<std::mutex> lk(mtx);
+                // Only a 206 carries this slice. A server that ignores Range
+                // sends the whole body from offset 0 with a 200, and error
+                // pages are not file data either; both are dropped before
+                // they reach the file or the sidecar.
+                if (failed || statuses[i] != 206 || seg.done + (curl_off_t)len > seg.length) return 0;
+                if (!writeAll(fd, data, len, seg.begin + seg.done)) return 0;
+                if (md5 && !catchingUp && hashed == seg.begin + seg.done) {
+                    md5->update(data, len);
+                    hashed += len;
+                }
+                seg.done += len;
+                received += len;
+                // The hashed prefix can only move on to the next segment
+                // once this one is whole.
+                if (seg.done == seg.length) cv.notify_one();
+                return len;
+            };
+            req.onProgress = [&](curl_off_t, curl_off_t) {
+                curl_off_t now;
+                {
+                    std::lock_guard<std::mutex> lk(mtx);
+                    if (failed || pd.aborted) return false;
+                    now = received;
+                }
+                return reportProgress(&pd, info.size, now);
+            };
+            DownloadEngine::instance().submit(std::move(req), [&, i](const DownloadEngine::Result& r) {
+                std::lock_guard<std::mutex> lk(mtx);
+                if (!r.ok() || r.status != 206 || segs[i].done != segs[i].length) failed = true;
+                results[i] = r;
+                --remaining;
+                cv.notify_one();
+            });
+        }
+
+        std::unique_lock<std::mutex> lk(mtx);
+        auto lastCheckpoint = std::chrono::steady_clock::now();
+        while (true) {
+            if (md5 && !failed && hashed < info.size) {
+                const Segment& seg = segs[hashed / segs[0].length];
+                curl_off_t from = hashed, end = seg.begin + seg.done;
+                if (end > from) {
+                    catchingUp = true;
+                    lk.unlock();
+                    bool ok = hashRange(fd, *md5, from, end);
+                    lk.lock();
+                    catchingUp = false;
+                    hashed = end;
+                    if (!ok) failed = true;
+                    continue;
+                }
+            }
+            if (remaining == 0) break;
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastCheckpoint >= std::chrono::seconds(5)) {
+                lastCheckpoint = now;
+                PartState snapshot = st;
+                lk.unlock();
+                checkpoint(snapshot);
+                lk.lock();
+                continue;
+            }
+            cv.wait_until(lk, lastCheckpoint + std::chrono::seconds(5));
+        }
+        lk.unlock();
+
+        for (size_t i = 0; i < segs.size(); ++i) {
+            if (!res.ok()) break;
+            res = results[i];
+            if (res.ok() && (res.status != 206 || segs[i].done != segs[i].length)) res.code = CURLE_PARTIAL_FILE;
+        }
+        res.bytes = received;
+        if (res.ok() && md5 && hashed != info.size) res.code = CURLE_READ_ERROR;
+        if (res.ok()) {
+            if (fsync(fd) != 0) res.code = CURLE_WRITE_ERROR;
+        } else {
+            checkpoint(st);
+        }
+        close(fd);
+        return res;
+    }
+
+    bool HTTP::checksumMatches(const std::string& digest, const std::string& expected)
+    {
+        if (digest.size() != expected.size()) return false;
+        for (size_t i = 0; i < digest.size(); ++i)
+            if (std::tolower((unsigned char)digest[i]) != std::tolower((unsigned char)expected[i])) return false;
+        return true;
+    }
+
     bool HTTP::download(const std::string& url,
                     const std::string& dest,
-                    ProgressCallback cb)
+                    ProgressCallback cb,
+                    const std::string& md5,
+                    long long knownSize)
     {
         fs::path finalPath = dest;
         fs::path partPath = dest + ".part";
 
         fs::create_directories(finalPath.parent_path());
 
+        // A file the caller knows to be too small to split is fetched in one
+        // GET; the HEAD would only add a round trip.
+        RemoteInfo info;
+        if (knownSize > 0 && knownSize < kSegmentThreshold) {
+            info.url = url;
+            info.size = knownSize;
+        } else {
+            info = probe(url);
+        }
+        bool segmented = info.ranges && info.size >= kSegmentThreshold;
+        if (segmented) LOG_DEBUG("Downloading %s in segments (%lld bytes)", url.c_str(), (long long)info.size);
+
         int retries = 3;
         while (retries--) {
-            std::ofstream ofs(partPath, std::ios::binary | std::ios::trunc);
-            if (!ofs.is_open()) {
-                LOG_ERROR("Failed to open file for writing: %s", partPath.c_str());
-                return false;
-            }
-
-            CURL* curl = curl_easy_init();
-            if (!curl) return false;
-
             ProgData pd{cb, std::chrono::steady_clock::now(), std::chrono::steady_clock::now()};
+            MD5 hasher;
+            MD5* hash = md5.empty() ? nullptr : &hasher;
 
-            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-            curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-            curl_easy_setopt(curl, CURLOPT_USERAGENT, "RSJFW/1.1.0");
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, fileWriteCallback);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ofs);
-            curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 15L);
+            auto res = segmented ? downloadSegmented(info, partPath, pd, hash) : downloadStream(url, info, partPath, pd, hash);
 
-            if (cb) {
-                curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
-                curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progressCallback);
-                curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &pd);
+            if (segmented && res.status == 200) {
+                LOG_WARN("Server ignored Range for %s, falling back to a single stream", url.c_str());
+                segmented = false;
             }
+            if (res.status == 416) clearPartState(partPath);
 
-            CURLcode res = curl_easy_perform(curl);
-            ofs.flush();
-            ofs.close();
-            curl_easy_cleanup(curl);
+            if (res.ok() && hash && !checksumMatches(hasher.hexDigest(), md5)) {
+                LOG_WARN("Checksum mismatch for %s, discarding download", url.c_str());
+                fs::remove(partPath);
+                clearPartState(partPath);
+                res.code = CURLE_PARTIAL_FILE;
+            }
 
-            if (res == CURLE_OK) {
+            if (res.ok()) {
                 std::error_code ec;
                 fs::rename(partPath, finalPath, ec);
                 if (ec) {
                     LOG_ERROR("Rename failed: %s", ec.message().c_str());
                     fs::remove(partPath);
+                    clearPartState(partPath);
                     return false;
                 }
+                clearPartState(partPath);
                 return true;
             } else {
-                fs::remove(partPath);
+                // Keep the .part and its sidecar; the next attempt resumes.
+                auto* bg = DownloadEngine::currentBackground();
+                if (bg && bg->cancel) return false;
                 if (retries > 0) {
-                    LOG_WARN("Download failed (%s), retrying...", curl_easy_strerror(res));
+                    if (res.code != CURLE_OK && res.status < 300)
+                        LOG_WARN("Download failed (%s), retrying...", curl_easy_strerror(res.code));
+                    else
+                        LOG_WARN("Download failed (HTTP %ld), retrying...", res.status);
                     std::this_thread::sleep_for(std::chrono::seconds(2));
                     continue;
                 }
@@ -159,4 +605,111 @@ namespace rsjfw
         }
         return false;
     }
+
+    struct HTTPStream::State
+    {
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::deque<std::string> chunks;
+        std::string current;
+        size_t buffered = 0;
+        size_t maxBuffered = 0;
+        bool paused = false;
+        bool finished = false;
+        bool tapFailed = false;
+        // Engine thread only: status of the response being received.
+        long status = 0;
+        DownloadEngine::Result result;
+        DownloadEngine::Id id = 0;
+        ProgData pd;
+        Tap tap;
+    };
+
+    HTTPStream::HTTPStream(const std::string& url, ProgressCallback cb, Tap tap, size_t maxBuffered)
+        : state_(std::make_shared<State>())
+    {
+        auto st = state_;
+        st->maxBuffered = maxBuffered;
+        st->pd = {cb, std::chrono::steady_clock::now(), std::chrono::steady_clock::now()};
+        st->tap = std::move(tap);
+
+        DownloadEngine::Request req;
+        req.url = url;
+        req.onHeader = [st](std::string_view line) {
+            if (long code = statusOf(line)) st->status = code;
+        };
+        req.onData = [st](const char* data, size_t len) -> size_t {
+            // An error page is neither a zip nor cache material; failing
+            // here makes read() return -1 before the reader sees any of it.
+            if (st->status < 200 || st->status > 299) return 0;
+            {
+                std::lock_guard<std::mutex> lk(st->mtx);
+                if (st->buffered >= st->maxBuffered) {
+                    st->paused = true;
+                    return CURL_WRITEFUNC_PAUSE;
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lk(st->mtx);
+                st->chunks.emplace_back(data, len);
+                st->buffered += len;
+            }
+            st->cv.notify_one();
+            return len;
+        };
+        if (cb) {
+            req.onProgress = [st](curl_off_t total, curl_off_t now) {
+                {
+                    // Time spent waiting on the reader is not a stall.
+                    std::lock_guard<std::mutex> lk(st->mtx);
+                    if (st->paused) return true;
+                }
+                return reportProgress(&st->pd, total, now);
+            };
+        }
+        st->id = DownloadEngine::instance().submit(std::move(req), [st](const DownloadEngine::Result& r) {
+            {
+                std::lock_guard<std::mutex> lk(st->mtx);
+                st->result = r;
+                st->finished = true;
+            }
+            st->cv.notify_all();
+        });
+    }
+
+    HTTPStream::~HTTPStream()
+    {
+        std::unique_lock<std::mutex> lk(state_->mtx);
+        if (!state_->finished) DownloadEngine::instance().cancel(state_->id);
+        state_->cv.wait(lk, [&] { return state_->finished; });
+    }
+
+    long HTTPStream::read(const void** block)
+    {
+        auto& st = *state_;
+        if (st.tapFailed) return -1;
+        bool resume = false;
+        {
+            std::unique_lock<std::mutex> lk(st.mtx);
+            st.cv.wait(lk, [&] { return !st.chunks.empty() || st.finished; });
+            if (st.chunks.empty()) return st.result.ok() ? 0 : -1;
+            st.current = std::move(st.chunks.front());
+            st.chunks.pop_front();
+            st.buffered -= st.current.size();
+            if (st.paused && st.buffered <= st.maxBuffered / 2) {
+                st.paused = false;
+                resume = true;
+            }
+        }
+        if (resume) DownloadEngine::instance().resume(st.id);
+        // Runs here rather than in onData so a slow tap (a disk write, a
+        // hash) stalls this reader and not every transfer on the engine.
+        if (st.tap && !st.tap(st.current.data(), st.current.size())) {
+            st.tapFailed = true;
+            DownloadEngine::instance().cancel(st.id);
+            return -1;
+        }
+        *block = st.current.data();
+        return (long)st.current.size();
+    }
 }
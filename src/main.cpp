@@ -8,6 +8,7 @@
 #include <thread>
 #include <vector>
 
+#include "cache_manager.h"
 #include "config.h"
 #include "diagnostics.h"
 #include "downloader/roblox_manager.h"
@@ -31,6 +32,7 @@ void showHelp() {
       << "  rsjfw install             Install latest version without "
          "launching\n"
       << "  rsjfw kill                Kill all running Studio instances\n"
+      << "  rsjfw gc [GB] [--dry-run] Shrink ~/.rsjfw to the disk budget\n"
       << "  rsjfw help                Show this help message\n\n"
       << "Options:\n"
       << "  -v, --verbose             Enable debug logging\n"
@@ -187,6 +189,36 @@ int main(int argc, char *argv[]) {
     } else if (cmd == "kill") {
       killStudio();
       return 0;
+    } else if (cmd == "gc") {
+      auto &cm = rsjfw::CacheManager::instance();
+      uintmax_t budget = cm.configuredBudget();
+      bool dryRun = false;
+      for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "--dry-run")
+          dryRun = true;
+        else
+          budget = (uintmax_t)(std::atof(args[i].c_str()) * (1ull << 30));
+      }
+      if (budget == 0) {
+        std::cout << "No disk budget set; pass one in GB, e.g. rsjfw gc 10\n";
+        return 1;
+      }
+      auto report = cm.collect(budget, dryRun);
+      auto line = [](const char *name, uintmax_t bytes) {
+        std::cout << "  " << name << rsjfw::CacheManager::formatSize(bytes)
+                  << "\n";
+      };
+      line("cache      ", report.before.cache);
+      line("versions   ", report.before.versions);
+      line("store      ", report.before.store);
+      line("downloads  ", report.before.downloads);
+      line("total      ", report.before.total());
+      for (const auto &path : report.evicted)
+        std::cout << (dryRun ? "would remove " : "removed ") << path << "\n";
+      std::cout << (dryRun ? "Would free " : "Freed ")
+                << rsjfw::CacheManager::formatSize(report.freed) << " (budget "
+                << rsjfw::CacheManager::formatSize(budget) << ")\n";
+      return 0;
     } else if (cmd == "register") {
       LOG_INFO("Registering RSJFW desktop integration...");
       auto &diag = rsjfw::Diagnostics::instance();
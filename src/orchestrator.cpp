@@ -1,7 +1,9 @@
 #include "orchestrator.h"
+#include "cache_manager.h"
 #include "config.h"
 #include "credential_manager.h"
 #include "diagnostics.h"
+#include "download_engine.h"
 #include "downloader/dxvk_manager.h"
 #include "downloader/roblox_manager.h"
 #include "downloader/wine_manager.h"
@@ -18,25 +20,23 @@
 #include <iostream>
 #include <nlohmann/json.hpp>
 #include <sstream>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 namespace rsjfw {
 
 namespace fs = std::filesystem;
 
+// Background installs of a newer Studio share this cap and cancel flag.
+static DownloadEngine::Background prefetchBackground;
+
 Orchestrator &Orchestrator::instance() {
   static Orchestrator inst;
   return inst;
 }
 
-Orchestrator::~Orchestrator() {
-  cancel();
-  if (workerThread_.joinable())
-    try {
-      workerThread_.join();
-    } catch (const std::exception &e) {
-    }
-}
+Orchestrator::~Orchestrator() { shutdown(); }
 
 static std::string stateToString(LauncherState s) {
   switch (s) {
@@ -93,6 +93,67 @@ void Orchestrator::shutdown() {
     } catch (...) {
     }
   }
+  prefetchBackground.cancel = true;
+  if (prefetchThread_.joinable()) {
+    try {
+      prefetchThread_.join();
+    } catch (...) {
+    }
+  }
+}
+
+void Orchestrator::startPrefetch(const std::string &channel) {
+  if (prefetching_.exchange(true))
+    return;
+  if (prefetchThread_.joinable())
+    prefetchThread_.join();
+  prefetchBackground.cancel = false;
+  prefetchThread_ = std::thread(&Orchestrator::prefetch, this, channel);
+}
+
+// Checks for a newer Studio and, if there is one, installs it while the
+// current session runs. A background installVersion builds the version in
+// a staging directory and renames it into place once complete, so launches
+// never see it half-written, and the next one picks it up as the newest
+// installed version.
+void Orchestrator::prefetch(std::string channel) {
+  // Nice 19 and the idle I/O class; the install workers spawned from this
+  // thread inherit both.
+  pid_t tid = (pid_t)syscall(SYS_gettid);
+  setpriority(PRIO_PROCESS, tid, 19);
+  const int ioprioWhoProcess = 1, ioprioClassIdle = 3, ioprioClassShift = 13;
+  syscall(SYS_ioprio_set, ioprioWhoProcess, tid,
+          ioprioClassIdle << ioprioClassShift);
+
+  try {
+    auto &cfg = Config::instance().getGeneral();
+    auto &rbx = downloader::RobloxManager::instance();
+    prefetchBackground.maxBytesPerSec = (curl_off_t)cfg.prefetchRateKb * 1024;
+    DownloadEngine::BackgroundScope scope(&prefetchBackground);
+
+    auto latest = rbx.getLatestVersionGUID(channel);
+    LOG_DEBUG("background update check result: %s", latest.c_str());
+    if (!latest.empty() && cfg.prefetchUpdates && !rbx.isInstalled(latest) &&
+        !prefetchBackground.cancel) {
+      LOG_INFO("prefetching roblox studio version %s in the background",
+               latest.c_str());
+      if (rbx.installVersion(latest))
+        LOG_INFO("roblox studio %s staged for the next launch",
+                 latest.c_str());
+      else if (prefetchBackground.cancel)
+        LOG_INFO("background install of %s cancelled", latest.c_str());
+      else
+        LOG_WARN("background install of %s failed", latest.c_str());
+    }
+  } catch (const std::exception &e) {
+    LOG_WARN("background update check failed: %s", e.what());
+  }
+
+  // A freshly staged version is the usual reason to be over budget.
+  uintmax_t budget = CacheManager::configuredBudget();
+  if (budget && !prefetchBackground.cancel)
+    CacheManager::instance().collect(budget);
+  prefetching_ = false;
 }
 
 void Orchestrator::setStatus(float p, const std::string &s) {
@@ -203,15 +264,8 @@ void Orchestrator::worker(std::string arg) {
       guid = installed[0];
       LOG_DEBUG("using local version for speed: %s", guid.c_str());
 
-      if (!fastPath) {
-          std::thread([&rbx, &cfg]() {
-            try {
-              auto latest = rbx.getLatestVersionGUID(cfg.channel);
-              LOG_DEBUG("background update check result: %s", latest.c_str());
-            } catch (...) {
-            }
-          }).detach();
-      }
+      if (!fastPath)
+        startPrefetch(cfg.channel);
     }
 
     if (guid.empty() && !stop_) {
@@ -232,6 +286,7 @@ void Orchestrator::worker(std::string arg) {
     }
 
     LOG_DEBUG("resolved studio version: %s", guid.c_str());
+    CacheManager::instance().touchVersion(guid);
 
     if (stop_) {
       setState(LauncherState::FINISHED);
@@ -389,6 +444,10 @@ void Orchestrator::worker(std::string arg) {
     fs::path versionDir = fs::path(PathManager::instance().versions()) / guid;
     fs::path settingsDir = versionDir / "ClientSettings";
     fs::create_directories(settingsDir);
+    // Version files may be read-only links shared with other versions
+    // (see ContentStore); replace them rather than write through.
+    std::error_code rmEc;
+    fs::remove(settingsDir / "ClientAppSettings.json", rmEc);
     std::ofstream(settingsDir / "ClientAppSettings.json")
         << clientSettings.dump(4);
 
@@ -402,6 +461,7 @@ void Orchestrator::worker(std::string arg) {
         if (fs::exists(src64)) {
           for (const auto &entry : fs::directory_iterator(src64)) {
             if (entry.path().extension() == ".dll") {
+              fs::remove(versionDir / entry.path().filename(), rmEc);
               fs::copy_file(entry.path(), versionDir / entry.path().filename(),
                             fs::copy_options::overwrite_existing);
             }
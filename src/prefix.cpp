@@ -309,6 +309,7 @@ bool Prefix::installDxvk(const std::string &dxvkRoot) {
   LOG_INFO("injecting dxvk into prefix...");
   fs::path sys32 = fs::path(rootDir_) / "drive_c" / "windows" / "system32";
   fs::path syswow = fs::path(rootDir_) / "drive_c" / "windows" / "syswow64";
+  std::vector<std::string> overrides;
   auto installDlls = [&](fs::path src, fs::path dst) {
     if (!fs::exists(src) || !fs::exists(dst))
       return;
@@ -319,8 +320,7 @@ bool Prefix::installDxvk(const std::string &dxvkRoot) {
           if (fs::exists(target))
             fs::remove(target);
           fs::copy_file(entry.path(), target);
-          registryAdd("HKCU\\Software\\Wine\\DllOverrides",
-                      entry.path().stem().string(), "native", "REG_SZ");
+          overrides.push_back(entry.path().stem().string());
         } catch (...) {
         }
       }
@@ -333,7 +333,12 @@ bool Prefix::installDxvk(const std::string &dxvkRoot) {
     installDlls(root / "x86_64-windows", sys32);
     installDlls(root / "i386-windows", syswow);
   }
-  return registryCommit();
+  // The DLL copies are done first so the registry lock is not held
+  // across them.
+  Registry::Transaction tx(registry_);
+  for (const auto &dll : overrides)
+    tx.setString("HKCU\\Software\\Wine\\DllOverrides", dll, "native");
+  return tx.commit();
 }
 
 } // namespace rsjfw
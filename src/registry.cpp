@@ -1,34 +1,54 @@
 #include "registry.h"
 #include "logger.h"
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
 #include <chrono>
 #include <cstring>
 #include <fcntl.h>
 #include <filesystem>
-#include <fstream>
-#include <iomanip>
-#include <sstream>
+#include <istream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <poll.h>
 #include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <thread>
+#include <unistd.h>
+#include <unordered_set>
+#include <utility>
 
 namespace rsjfw {
 
 namespace fs = std::filesystem;
 
-static std::string decodeW(const std::vector<uint8_t> &b) {
-  if (b.size() < 2)
-    return "";
-  std::string res;
+// Narrows UTF-16LE string data. A multi-string keeps its NUL separators,
+// minus the trailing terminators. Fails rather than drop anything the
+// narrow form cannot hold back: non-ASCII text, an odd byte count or
+// data after a single string's terminator.
+static bool decodeW(std::span<const uint8_t> b, bool list, std::string &res) {
+  if (b.size() % 2)
+    return false;
+  bool ended = false;
   for (size_t i = 0; i + 1 < b.size(); i += 2) {
     uint16_t val = b[i] | (static_cast<uint16_t>(b[i + 1]) << 8);
-    if (val == 0)
-      break;
-    if (val < 128)
-      res += static_cast<char>(val);
+    if (val >= 128 || (ended && val != 0))
+      return false;
+    if (val == 0 && !list)
+      ended = true;
     else
-      res += '?';
+      res += static_cast<char>(val);
   }
-  return res;
+  while (!res.empty() && res.back() == '\0')
+    res.pop_back();
+  return true;
 }
 
 static std::vector<uint8_t> to_utf16(const std::string &s) {
@@ -42,42 +62,422 @@ static std::vector<uint8_t> to_utf16(const std::string &s) {
   return out;
 }
 
-static std::string to_hex_wrapped(const std::vector<uint8_t> &data,
-                                  size_t startCol) {
-  std::stringstream ss;
+// Lookup tables for the hex codecs: every byte's two lowercase digits, and
+// every character's nibble value (0xff for non-digits).
+static constexpr auto kHexPairs = [] {
+  std::array<char, 512> t{};
+  constexpr char digits[] = "0123456789abcdef";
+  for (int i = 0; i < 256; ++i) {
+    t[2 * i] = digits[i >> 4];
+    t[2 * i + 1] = digits[i & 15];
+  }
+  return t;
+}();
+
+static constexpr auto kHexValues = [] {
+  std::array<uint8_t, 256> t{};
+  t.fill(0xff);
+  for (int c = 0; c < 10; ++c)
+    t['0' + c] = static_cast<uint8_t>(c);
+  for (int c = 0; c < 6; ++c)
+    t['a' + c] = t['A' + c] = static_cast<uint8_t>(10 + c);
+  return t;
+}();
+
+// Appends data as comma-separated hex, breaking the line with "\\" once the
+// running column, starting at startCol, reaches 75. Continuation lines are
+// indented by two spaces, as Wine writes them.
+static void appendHexWrapped(std::string &out, std::span<const uint8_t> data,
+                             size_t startCol) {
+  if (data.empty())
+    return;
+  // Three characters per byte, plus a four-character break at most once per
+  // 24 bytes and once more for the first line.
+  size_t base = out.size();
+  out.resize(base + data.size() * 3 + (data.size() / 24 + 1) * 4);
+  char *p = out.data() + base;
   size_t col = startCol;
-  for (size_t i = 0; i < data.size(); ++i) {
-    ss << std::hex << std::setw(2) << std::setfill('0')
-       << static_cast<int>(data[i]);
-    if (i < data.size() - 1) {
-      ss << ",";
-      col += 3;
-      if (col >= 75) {
-        ss << "\\\n  ";
-        col = 2;
-      }
+  const size_t last = data.size() - 1;
+  for (size_t i = 0; i < last; ++i) {
+    std::memcpy(p, &kHexPairs[2 * data[i]], 2);
+    p[2] = ',';
+    p += 3;
+    col += 3;
+    if (col >= 75) {
+      std::memcpy(p, "\\\n  ", 4);
+      p += 4;
+      col = 2;
     }
   }
-  return ss.str();
+  std::memcpy(p, &kHexPairs[2 * data[last]], 2);
+  p += 2;
+  out.resize(p - out.data());
 }
 
-static std::vector<uint8_t> parseBytes(const std::string &s) {
-  std::vector<uint8_t> out;
-  std::stringstream ss(s);
-  std::string b;
-  while (std::getline(ss, b, ',')) {
-    size_t st = b.find_first_not_of(" \t\r\n");
-    if (st == std::string::npos)
+static std::string to_hex_wrapped(std::span<const uint8_t> data,
+                                  size_t startCol) {
+  std::string out;
+  appendHexWrapped(out, data, startCol);
+  return out;
+}
+
+static void parseBytes(std::string_view s, std::pmr::vector<uint8_t> &out) {
+  out.reserve(out.size() + s.size() / 3 + 1);
+  const char *p = s.data();
+  const char *end = p + s.size();
+  while (p < end) {
+    char c = *p;
+    if (c == ',' || c == ' ' || c == '\t' || c == '\r' || c == '\n' ||
+        c == '\\') {
+      ++p;
+      continue;
+    }
+    // Wine always writes two digits per byte; anything else goes through
+    // from_chars so odd hand-written tokens keep their old meaning.
+    uint8_t hi = kHexValues[static_cast<uint8_t>(c)];
+    uint8_t lo = p + 1 < end ? kHexValues[static_cast<uint8_t>(p[1])] : 0xff;
+    if (hi != 0xff && lo != 0xff &&
+        (p + 2 == end || kHexValues[static_cast<uint8_t>(p[2])] == 0xff)) {
+      out.push_back(static_cast<uint8_t>(hi << 4 | lo));
+      p += 2;
+    } else {
+      unsigned long v = 0;
+      auto res = std::from_chars(p, end, v, 16);
+      if (res.ec == std::errc())
+        out.push_back(static_cast<uint8_t>(v));
+      p = res.ptr;
+    }
+    // Anything after the number up to the next comma is ignored.
+    while (p < end && *p != ',')
+      ++p;
+  }
+}
+
+static void appendEscaped(std::string &out, std::string_view s) {
+  size_t run = 0;
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '\\' || s[i] == '"') {
+      out.append(s.data() + run, i - run);
+      out += '\\';
+      run = i;
+    }
+  }
+  out.append(s.data() + run, s.size() - run);
+}
+
+// Appends v in the given base, left-padded with zeros to width digits.
+template <typename T>
+static void appendNumber(std::string &out, T v, int base, size_t width = 0) {
+  char buf[24];
+  auto res = std::to_chars(buf, buf + sizeof(buf), v, base);
+  size_t n = static_cast<size_t>(res.ptr - buf);
+  if (n < width)
+    out.append(width - n, '0');
+  out.append(buf, n);
+}
+
+static std::string_view trimView(std::string_view s) {
+  size_t st = s.find_first_not_of(" \t\r");
+  if (st == std::string_view::npos)
+    return {};
+  size_t en = s.find_last_not_of(" \t\r");
+  return s.substr(st, en - st + 1);
+}
+
+template <typename T>
+static bool parseNumber(std::string_view s, T &out, int base) {
+  s = trimView(s);
+  if (base == 16 && s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+    s.remove_prefix(2);
+  auto res = std::from_chars(s.data(), s.data() + s.size(), out, base);
+  return res.ec == std::errc() && res.ptr != s.data();
+}
+
+// Read-only view of a whole hive file. Hives are mapped rather than streamed
+// so the parser can tokenize in place without per-line allocations.
+struct MappedFile {
+  const char *data = nullptr;
+  size_t size = 0;
+  bool ok = false;
+  struct stat st {};
+
+  explicit MappedFile(const fs::path &p) {
+    int fd = ::open(p.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return;
+    if (fstat(fd, &st) == 0) {
+      size = static_cast<size_t>(st.st_size);
+      if (size == 0) {
+        ok = true;
+      } else {
+        void *m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+          madvise(m, size, MADV_SEQUENTIAL);
+          data = static_cast<const char *>(m);
+          ok = true;
+        }
+      }
+    }
+    ::close(fd);
+  }
+  ~MappedFile() {
+    if (data)
+      munmap(const_cast<char *>(data), size);
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  std::string_view view() const { return {data, data ? size : 0}; }
+};
+
+// Replaces p with data via a temporary file and rename, issuing the data
+// as one write. With durable set the data is fsynced before the rename so a
+// crash leaves either the old file or the new one.
+static bool writeFileAtomic(const fs::path &p, std::string_view data,
+                            bool durable) {
+  fs::path tmp = p;
+  tmp += ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return false;
+  bool ok = true;
+  while (!data.empty()) {
+    ssize_t n = ::write(fd, data.data(), data.size());
+    if (n < 0 && errno == EINTR)
       continue;
-    if (b[st] == '\\')
+    if (n <= 0) {
+      ok = false;
       break;
-    try {
-      out.push_back(
-          static_cast<uint8_t>(std::stoul(b.substr(st), nullptr, 16)));
-    } catch (...) {
     }
+    data.remove_prefix(static_cast<size_t>(n));
   }
-  return out;
+  if (ok && durable)
+    ok = ::fsync(fd) == 0;
+  ok &= ::close(fd) == 0;
+  if (ok)
+    ok = ::rename(tmp.c_str(), p.c_str()) == 0;
+  if (!ok)
+    ::unlink(tmp.c_str());
+  return ok;
+}
+
+// Offset of the first line at or after `from`, which must be a line start,
+// that opens a section, or buf.size() if there is none. Only line starts are
+// inspected, so the scan runs at memchr speed.
+static size_t nextSection(std::string_view buf, size_t from) {
+  while (from < buf.size() && buf[from] != '[') {
+    const void *nl = memchr(buf.data() + from, '\n', buf.size() - from);
+    if (!nl)
+      return buf.size();
+    from = static_cast<const char *>(nl) - buf.data() + 1;
+  }
+  return std::min(from, buf.size());
+}
+
+// Section index of a lazily opened hive. Sections point into the mapping,
+// which stays alive with the arena; a section is parsed into the tree the
+// first time a lookup reaches its path and is written back verbatim until
+// its key is modified.
+struct LazyHive {
+  struct Section {
+    std::string_view raw;  // header line through the blank line after it
+    std::string_view path; // escaped, as written in the header
+    size_t nextSame = SIZE_MAX; // next section with the same path
+    bool loaded = false;
+    bool rewritten = false;
+  };
+
+  // Shared with clones of the arena; every view below points into it.
+  std::shared_ptr<const MappedFile> file;
+  std::string_view preamble;
+  std::vector<Section> sections;
+  // First section for each path; duplicates chain through nextSame.
+  std::unordered_map<std::string_view, size_t, CaseInsensitiveHash,
+                     CaseInsensitiveEqual>
+      byPath;
+  // Keys that were not in the file but have been written by a later save.
+  std::unordered_set<std::string, CaseInsensitiveHash, CaseInsensitiveEqual>
+      appended;
+
+  explicit LazyHive(const fs::path &p)
+      : file(std::make_shared<const MappedFile>(p)) {}
+
+  // One pass over the mapping: every line that starts with '[' opens a
+  // section. Nothing else is tokenized.
+  void index() {
+    std::string_view buf = file->view();
+    size_t pos = nextSection(buf, 0);
+    preamble = buf.substr(0, pos);
+    // Sections in typical hives average a few hundred bytes.
+    sections.reserve(buf.size() / 256);
+    byPath.reserve(buf.size() / 256);
+    std::vector<size_t> lastSame;
+    lastSame.reserve(buf.size() / 256);
+    while (pos < buf.size()) {
+      size_t eol = buf.find('\n', pos);
+      size_t next = eol == std::string_view::npos ? buf.size()
+                                                  : nextSection(buf, eol + 1);
+      Section sec;
+      sec.raw = buf.substr(pos, next - pos);
+      std::string_view header = buf.substr(pos, eol - pos);
+      size_t close = header.find(']');
+      if (close != std::string_view::npos)
+        sec.path = header.substr(1, close - 1);
+      size_t id = sections.size();
+      auto [it, fresh] = byPath.try_emplace(sec.path, id);
+      if (!fresh) {
+        sections[lastSame[it->second]].nextSame = id;
+        lastSame[it->second] = id;
+      }
+      lastSame.push_back(id);
+      sections.push_back(sec);
+      pos = next;
+    }
+    if (file->data)
+      madvise(const_cast<char *>(file->data), file->size, MADV_RANDOM);
+  }
+};
+
+// Binary image of a parsed hive, stored next to the text hive so warm
+// launches can skip the text parser. It is only trusted while the hive's
+// size, mtime and inode match the stamp it was written for.
+static constexpr char kCacheMagic[8] = {'R', 'S', 'J', 'F', 'W', 'H', 'C', '1'};
+
+HiveStamp::HiveStamp(const struct stat &st)
+    : size(static_cast<uint64_t>(st.st_size)), mtimeSec(st.st_mtim.tv_sec),
+      mtimeNsec(st.st_mtim.tv_nsec), inode(static_cast<uint64_t>(st.st_ino)) {}
+
+template <typename T> static void putRaw(std::string &out, T v) {
+  out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+static void putBytes(std::string &out, std::string_view b) {
+  putRaw<uint32_t>(out, static_cast<uint32_t>(b.size()));
+  out.append(b);
+}
+
+struct HiveCacheReader {
+  std::string_view buf;
+  bool ok = true;
+
+  template <typename T> T get() {
+    T v{};
+    if (buf.size() < sizeof(T)) {
+      ok = false;
+      return v;
+    }
+    std::memcpy(&v, buf.data(), sizeof(T));
+    buf.remove_prefix(sizeof(T));
+    return v;
+  }
+  std::string_view bytes() {
+    uint32_t n = get<uint32_t>();
+    if (!ok || buf.size() < n) {
+      ok = false;
+      return {};
+    }
+    std::string_view v = buf.substr(0, n);
+    buf.remove_prefix(n);
+    return v;
+  }
+};
+
+static fs::path cachePath(const fs::path &hive) {
+  fs::path p = hive;
+  p += ".rsjfw-cache";
+  return p;
+}
+
+void RegistryKey::serialize(std::string &out) const {
+  putBytes(out, name);
+  putRaw<uint64_t>(out, modified);
+  putRaw<uint32_t>(out, unixTime);
+  putRaw<uint8_t>(out, (isLink ? 1 : 0) | (wasInFile ? 2 : 0));
+  putRaw<uint32_t>(out, static_cast<uint32_t>(values.size()));
+  for (const auto &v : values) {
+    putBytes(out, v.name);
+    putRaw<uint32_t>(out, static_cast<uint32_t>(v.type));
+    putRaw<uint32_t>(out, v.customType);
+    putBytes(out, std::string_view(reinterpret_cast<const char *>(v.data.data()),
+                                   v.data.size()));
+  }
+  putRaw<uint32_t>(out, static_cast<uint32_t>(subkeys.size()));
+  for (const RegistryKey *sk : subkeys)
+    sk->serialize(out);
+}
+
+// Rebuilds this key's values and children from a serialize() image. The
+// key's own name has already been consumed by the caller.
+bool RegistryKey::deserialize(HiveCacheReader &in) {
+  modified = in.get<uint64_t>();
+  unixTime = in.get<uint32_t>();
+  uint8_t flags = in.get<uint8_t>();
+  isLink = flags & 1;
+  wasInFile = flags & 2;
+  uint32_t nv = in.get<uint32_t>();
+  if (!in.ok || nv > in.buf.size())
+    return false;
+  values.reserve(nv);
+  for (uint32_t i = 0; i < nv && in.ok; ++i) {
+    std::string_view vn = in.bytes();
+    auto type = static_cast<RegistryType>(in.get<uint32_t>());
+    uint32_t customType = in.get<uint32_t>();
+    std::string_view d = in.bytes();
+    values.emplace_back(
+        vn, type,
+        std::span(reinterpret_cast<const uint8_t *>(d.data()), d.size()),
+        customType);
+  }
+  reindexValues();
+  uint32_t ns = in.get<uint32_t>();
+  if (!in.ok || ns > in.buf.size())
+    return false;
+  subkeys.reserve(ns);
+  for (uint32_t i = 0; i < ns && in.ok; ++i) {
+    RegistryKey *n = get_allocator().new_object<RegistryKey>(in.bytes(), this);
+    subkeys.push_back(n);
+    if (!n->deserialize(in))
+      return false;
+  }
+  reindexSubkeys();
+  return in.ok;
+}
+
+static bool loadHiveCache(const fs::path &hivePath, const HiveStamp &stamp,
+                          std::shared_ptr<RegistryArena> &hive,
+                          std::string &relativePath) {
+  MappedFile mf(cachePath(hivePath));
+  if (!mf.ok || mf.size < sizeof(kCacheMagic) + sizeof(HiveStamp))
+    return false;
+  HiveCacheReader in{mf.view()};
+  if (std::memcmp(in.buf.data(), kCacheMagic, sizeof(kCacheMagic)) != 0)
+    return false;
+  in.buf.remove_prefix(sizeof(kCacheMagic));
+  HiveStamp cached = in.get<HiveStamp>();
+  if (!(cached == stamp))
+    return false;
+  std::string rel(in.bytes());
+  in.bytes(); // root name
+  auto arena = std::make_shared<RegistryArena>(mf.size + mf.size / 2);
+  if (!arena->root()->deserialize(in) || !in.buf.empty())
+    return false;
+  arena->settle();
+  hive = std::move(arena);
+  relativePath = std::move(rel);
+  return true;
+}
+
+static void writeHiveCache(const fs::path &hivePath, const HiveStamp &stamp,
+                           RegistryArena &hive,
+                           const std::string &relativePath) {
+  std::string out;
+  out.append(kCacheMagic, sizeof(kCacheMagic));
+  putRaw(out, stamp);
+  putBytes(out, relativePath);
+  hive.root()->serialize(out);
+
+  // The cache is rebuilt from the hive if lost, so it is not fsynced.
+  writeFileAtomic(cachePath(hivePath), out, false);
 }
 
 std::string RegistryValue::asString() const {
@@ -118,73 +518,159 @@ std::vector<std::string> RegistryValue::asMultiString() const {
   return out;
 }
 
-RegistryValue *RegistryKey::getValue(const std::string &name) {
+static bool iequals(std::string_view a, std::string_view b) {
+  return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+RegistryValue *RegistryKey::getValue(std::string_view name) {
+  return const_cast<RegistryValue *>(std::as_const(*this).getValue(name));
+}
+
+const RegistryValue *RegistryKey::getValue(std::string_view name) const {
+  if (!valueIndex_.empty()) {
+    auto it = valueIndex_.find(name);
+    return it == valueIndex_.end() ? nullptr : &values[it->second];
+  }
   for (auto &v : values)
-    if (strcasecmp(v.name.c_str(), name.c_str()) == 0)
+    if (iequals(v.name, name))
       return &v;
   return nullptr;
 }
 
-void RegistryKey::setValue(const std::string &name, RegistryType type,
-                           const std::vector<uint8_t> &data,
-                           uint32_t customType) {
+// Children are freed through their own allocator: after a parallel load
+// they live in a part arena, not in their parent's.
+RegistryKey::~RegistryKey() {
+  for (RegistryKey *sk : subkeys)
+    sk->get_allocator().delete_object(sk);
+}
+
+void RegistryKey::setValue(std::string_view name, RegistryType type,
+                           std::span<const uint8_t> data, uint32_t customType) {
   wasInFile = true;
   if (auto *v = getValue(name)) {
+    if (v->type == type && v->customType == customType &&
+        std::equal(v->data.begin(), v->data.end(), data.begin(), data.end()))
+      return;
     v->type = type;
-    v->data = data;
+    v->data.assign(data.begin(), data.end());
     v->customType = customType;
+    markDirty();
     return;
   }
-  values.push_back({name, type, data, customType});
+  putValue(RegistryValue(name, type, data, customType));
 }
 
-bool RegistryKey::deleteValue(const std::string &name) {
+void RegistryKey::putValue(RegistryValue &&nv) {
+  wasInFile = true;
+  markDirty();
+  if (auto *v = getValue(nv.name)) {
+    *v = std::move(nv);
+    return;
+  }
+  values.push_back(std::move(nv));
+  if (!valueIndex_.empty())
+    valueIndex_.emplace(values.back().name, values.size() - 1);
+  else if (values.size() > kIndexThreshold)
+    reindexValues();
+}
+
+bool RegistryKey::deleteValue(std::string_view name) {
   for (auto it = values.begin(); it != values.end(); ++it) {
-    if (strcasecmp(it->name.c_str(), name.c_str()) == 0) {
+    if (iequals(it->name, name)) {
       values.erase(it);
       wasInFile = true;
+      markDirty();
+      reindexValues();
       return true;
     }
   }
   return false;
 }
 
-RegistryKey *RegistryKey::add(const std::string &path) {
+void RegistryKey::reindexValues() {
+  valueIndex_.clear();
+  if (values.size() <= kIndexThreshold)
+    return;
+  valueIndex_.reserve(values.size());
+  for (size_t i = 0; i < values.size(); ++i)
+    valueIndex_.emplace(values[i].name, i);
+}
+
+void RegistryKey::reindexSubkeys() {
+  subkeyIndex_.clear();
+  if (subkeys.size() <= kIndexThreshold)
+    return;
+  subkeyIndex_.reserve(subkeys.size());
+  for (RegistryKey *sk : subkeys)
+    subkeyIndex_.emplace(sk->name, sk);
+}
+
+RegistryKey *RegistryKey::findChild(std::string_view name) const {
+  if (!subkeyIndex_.empty()) {
+    auto it = subkeyIndex_.find(name);
+    return it == subkeyIndex_.end() ? nullptr : it->second;
+  }
+  for (RegistryKey *sk : subkeys)
+    if (iequals(sk->name, name))
+      return sk;
+  return nullptr;
+}
+
+RegistryKey *RegistryKey::addChild(std::string_view name) {
+  RegistryKey *n = get_allocator().new_object<RegistryKey>(name, this);
+  subkeys.push_back(n);
+  n->markDirty();
+  if (!subkeyIndex_.empty())
+    subkeyIndex_.emplace(n->name, n);
+  else if (subkeys.size() > kIndexThreshold)
+    reindexSubkeys();
+  return n;
+}
+
+RegistryKey *RegistryKey::add(std::string_view path) {
   return queryPath(path, true);
 }
-RegistryKey *RegistryKey::query(const std::string &path) {
+RegistryKey *RegistryKey::query(std::string_view path) {
   return queryPath(path, false);
 }
 
-RegistryKey *RegistryKey::queryPath(const std::string &path, bool create) {
-  if (path.empty())
-    return this;
-  std::string seg;
-  std::stringstream ss(path);
+RegistryKey *RegistryKey::queryPath(std::string_view path, bool create) {
   RegistryKey *cur = this;
-  while (std::getline(ss, seg, '\\')) {
+  while (!path.empty()) {
+    size_t sep = path.find('\\');
+    std::string_view seg = path.substr(0, sep);
+    path = (sep == std::string_view::npos) ? std::string_view{}
+                                           : path.substr(sep + 1);
     if (seg.empty())
       continue;
-    RegistryKey *next = nullptr;
-    for (auto &sk : cur->subkeys) {
-      if (strcasecmp(sk->name.c_str(), seg.c_str()) == 0) {
-        next = sk.get();
-        break;
-      }
-    }
+    RegistryKey *next = cur->findChild(seg);
     if (!next) {
-      if (create) {
-        auto n = std::make_shared<RegistryKey>(seg, cur);
-        cur->subkeys.push_back(n);
-        next = n.get();
-      } else
+      if (!create)
         return nullptr;
+      next = cur->addChild(seg);
     }
     cur = next;
   }
   return cur;
 }
 
+void RegistryKey::markDirty() {
+  if (dirty_)
+    return;
+  RegistryKey *r = root();
+  if (r->loading_)
+    return;
+  dirty_ = true;
+  r->dirtyKeys_++;
+}
+
+void RegistryKey::clearDirty() {
+  dirty_ = false;
+  dirtyKeys_ = 0;
+  for (RegistryKey *sk : subkeys)
+    sk->clearDirty();
+}
+
 RegistryKey *RegistryKey::root() {
   RegistryKey *cur = this;
   while (cur->parent)
@@ -192,37 +678,201 @@ RegistryKey *RegistryKey::root() {
   return cur;
 }
 
-bool RegistryKey::deleteKey(const std::string &path) {
+bool RegistryKey::deleteKey(std::string_view path) {
   RegistryKey *k = query(path);
   if (!k || !k->parent)
     return false;
-  for (auto it = k->parent->subkeys.begin(); it != k->parent->subkeys.end();
-       ++it) {
-    if (it->get() == k) {
-      k->parent->subkeys.erase(it);
+  RegistryKey *p = k->parent;
+  for (auto it = p->subkeys.begin(); it != p->subkeys.end(); ++it) {
+    if (*it == k) {
+      p->subkeyIndex_.erase(k->name);
+      p->subkeys.erase(it);
+      k->get_allocator().delete_object(k);
+      p->markDirty();
       return true;
     }
   }
   return false;
 }
 
+void RegistryKey::absorb(RegistryKey &other) {
+  for (auto &v : other.values)
+    putValue(std::move(v));
+  if (other.modified)
+    modified = other.modified;
+  if (other.unixTime)
+    unixTime = other.unixTime;
+  isLink |= other.isLink;
+  wasInFile |= other.wasInFile;
+  for (RegistryKey *sk : other.subkeys) {
+    if (RegistryKey *mine = findChild(sk->name)) {
+      mine->absorb(*sk);
+      continue;
+    }
+    sk->parent = this;
+    subkeys.push_back(sk);
+    if (!subkeyIndex_.empty())
+      subkeyIndex_.emplace(sk->name, sk);
+    else if (subkeys.size() > kIndexThreshold)
+      reindexSubkeys();
+  }
+  other.subkeys.clear();
+  other.subkeyIndex_.clear();
+}
+
+// splitmix64 finalizer; spreads each item's hash before the
+// order-independent sums below.
+static uint64_t mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+static uint64_t fnv(uint64_t h, const void *data, size_t n) {
+  auto *p = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < n; ++i) {
+    h ^= p[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// Hash of everything mergeFrom() synchronizes. Names are case-folded since
+// lookups are case-insensitive, and values and children are summed so
+// their order does not matter. Every key's hash is recorded in memo.
+uint64_t RegistryKey::hashTree(const RegistryKey &k, HashMemo &memo) {
+  uint64_t h = CaseInsensitiveHash{}(k.name);
+  h = fnv(h, &k.modified, sizeof(k.modified));
+  h = fnv(h, &k.unixTime, sizeof(k.unixTime));
+  h = fnv(h, &k.isLink, sizeof(k.isLink));
+  uint64_t sum = mix(h);
+  for (const auto &v : k.values) {
+    uint64_t vh = CaseInsensitiveHash{}(v.name);
+    vh = fnv(vh, &v.type, sizeof(v.type));
+    vh = fnv(vh, &v.customType, sizeof(v.customType));
+    vh = fnv(vh, v.data.data(), v.data.size());
+    sum += mix(vh ^ v.data.size());
+  }
+  for (const RegistryKey *sk : k.subkeys)
+    sum += mix(hashTree(*sk, memo) + 1);
+  memo[&k] = sum;
+  return sum;
+}
+
+static size_t treeSize(const RegistryKey &k) {
+  size_t n = 1 + k.values.size();
+  for (const RegistryKey *sk : k.subkeys)
+    n += treeSize(*sk);
+  return n;
+}
+
+uint64_t RegistryKey::contentHash() const {
+  HashMemo memo;
+  return hashTree(*this, memo);
+}
+
+size_t RegistryKey::mergeFrom(const RegistryKey &other) {
+  HashMemo memo;
+  hashTree(*this, memo);
+  hashTree(other, memo);
+  return mergeTree(other, memo);
+}
+
+size_t RegistryKey::mergeTree(const RegistryKey &other, const HashMemo &memo) {
+  if (memo.at(this) == memo.at(&other))
+    return 0;
+  size_t changes = 0;
+
+  if (modified != other.modified || unixTime != other.unixTime ||
+      isLink != other.isLink) {
+    modified = other.modified;
+    unixTime = other.unixTime;
+    isLink = other.isLink;
+    wasInFile = true;
+    markDirty();
+    ++changes;
+  }
+
+  for (const auto &ov : other.values) {
+    const RegistryValue *mv = getValue(ov.name);
+    if (!mv)
+      putValue(RegistryValue(ov, get_allocator()));
+    else if (mv->type != ov.type || mv->customType != ov.customType ||
+             mv->data != ov.data)
+      setValue(ov.name, ov.type, ov.data, ov.customType);
+    else
+      continue;
+    ++changes;
+  }
+  std::vector<std::string> gone;
+  for (const auto &v : values)
+    if (!other.getValue(v.name))
+      gone.emplace_back(v.name);
+  for (const auto &n : gone)
+    deleteValue(n);
+  changes += gone.size();
+
+  for (const RegistryKey *osk : other.subkeys) {
+    if (RegistryKey *mine = findChild(osk->name)) {
+      changes += mine->mergeTree(*osk, memo);
+    } else {
+      addChild(osk->name)->copyFrom(*osk);
+      changes += treeSize(*osk);
+    }
+  }
+  std::vector<std::string> orphans;
+  for (const RegistryKey *sk : subkeys)
+    if (!other.findChild(sk->name)) {
+      orphans.emplace_back(sk->name);
+      changes += treeSize(*sk);
+    }
+  for (const auto &n : orphans)
+    deleteKey(n);
+  return changes;
+}
+
+void RegistryKey::cloneFrom(const RegistryKey &other) {
+  modified = other.modified;
+  isLink = other.isLink;
+  unixTime = other.unixTime;
+  wasInFile = other.wasInFile;
+  dirty_ = other.dirty_;
+  dirtyKeys_ = other.dirtyKeys_;
+  values.reserve(other.values.size());
+  for (const auto &v : other.values)
+    values.emplace_back(v);
+  subkeys.reserve(other.subkeys.size());
+  for (const RegistryKey *sk : other.subkeys) {
+    RegistryKey *c = get_allocator().new_object<RegistryKey>(sk->name, this);
+    c->cloneFrom(*sk);
+    subkeys.push_back(c);
+  }
+  reindexValues();
+  reindexSubkeys();
+}
+
 void RegistryKey::copyFrom(const RegistryKey &other) {
   values = other.values;
+  reindexValues();
   modified = other.modified;
   isLink = other.isLink;
   unixTime = other.unixTime;
   wasInFile = true;
+  markDirty();
 
+  for (RegistryKey *sk : subkeys)
+    sk->get_allocator().delete_object(sk);
   subkeys.clear();
-  for (const auto &sk : other.subkeys) {
-    auto n = std::make_shared<RegistryKey>(sk->name, this);
-    n->copyFrom(*sk);
-    subkeys.push_back(n);
-  }
+  subkeyIndex_.clear();
+  subkeys.reserve(other.subkeys.size());
+  for (const auto &sk : other.subkeys)
+    addChild(sk->name)->copyFrom(*sk);
 }
 
-std::string RegistryKey::unescape(const std::string &s) {
+std::string RegistryKey::unescape(std::string_view s) {
   std::string out;
+  out.reserve(s.size());
   for (size_t i = 0; i < s.length(); ++i) {
     if (s[i] == '\\' && i + 1 < s.length()) {
       if (s[i + 1] == '\\' || s[i + 1] == '"') {
@@ -236,158 +886,174 @@ std::string RegistryKey::unescape(const std::string &s) {
   return out;
 }
 
-std::string RegistryKey::escape(const std::string &s) {
+std::string RegistryKey::escape(std::string_view s) {
   std::string out;
-  for (unsigned char c : s) {
-    if (c == '\\')
-      out += "\\\\";
-    else if (c == '"')
-      out += "\\\"";
-    else
-      out += c;
-  }
+  appendEscaped(out, s);
   return out;
 }
 
-std::string RegistryKey::unquote(const std::string &s) {
+std::string RegistryKey::unquote(std::string_view s) {
   if (s.size() >= 2 && s.front() == '"' && s.back() == '"')
     return unescape(s.substr(1, s.size() - 2));
   return unescape(s);
 }
 
-std::optional<RegistryValue> RegistryKey::parseData(const std::string &val) {
+std::optional<RegistryValue> RegistryKey::parseData(std::string_view val) {
+  RegistryValue rv(get_allocator());
+  auto setString = [&](RegistryType t, const std::string &s) {
+    rv.type = t;
+    rv.data.assign(s.begin(), s.end());
+    return std::optional<RegistryValue>(std::move(rv));
+  };
   if (val.empty())
-    return RegistryValue{"", RegistryType::String, {}};
-  if (val[0] == '"') {
-    std::string s = unquote(val);
-    return RegistryValue{"", RegistryType::String, {s.begin(), s.end()}};
-  }
+    return rv;
+  if (val[0] == '"')
+    return setString(RegistryType::String, unquote(val));
   if (val == "-")
     return std::nullopt;
   size_t col = val.find(':');
-  if (col == std::string::npos)
+  if (col == std::string_view::npos)
     return std::nullopt;
-  std::string pref = val.substr(0, col), dat = val.substr(col + 1);
-  try {
-    if (pref == "dword") {
-      uint32_t v = std::stoul(dat, nullptr, 16);
-      std::vector<uint8_t> b(4);
-      std::memcpy(b.data(), &v, 4);
-      return RegistryValue{"", RegistryType::Dword, b};
-    }
-    if (pref.find("hex") == 0) {
-      std::vector<uint8_t> hex = parseBytes(dat);
-      RegistryType t = RegistryType::Binary;
-      std::vector<uint8_t> finalData = hex;
+  std::string_view pref = val.substr(0, col), dat = val.substr(col + 1);
+  if (pref == "dword") {
+    uint32_t v = 0;
+    if (!parseNumber(dat, v, 16))
+      return std::nullopt;
+    rv.type = RegistryType::Dword;
+    rv.data.resize(4);
+    std::memcpy(rv.data.data(), &v, 4);
+    return rv;
+  }
+  if (pref.substr(0, 3) == "hex") {
+    parseBytes(dat, rv.data);
+    rv.type = RegistryType::Binary;
+    if (pref.size() > 4 && pref[3] == '(' && pref.back() == ')') {
       uint32_t cType = 0;
-      if (pref == "hex")
-        t = RegistryType::Binary;
-      else if (pref.size() > 4 && pref[3] == '(' && pref.back() == ')') {
-        cType = std::stoul(pref.substr(4, pref.size() - 5), nullptr, 16);
-        if (cType == 1)
-          t = RegistryType::String;
-        else if (cType == 2) {
-          t = RegistryType::ExpandString;
-          std::string s = decodeW(hex);
-          finalData.assign(s.begin(), s.end());
-        } else if (cType == 6) {
-          t = RegistryType::Link;
-          std::string s = decodeW(hex);
-          finalData.assign(s.begin(), s.end());
-        } else if (cType == 7) {
-          t = RegistryType::MultiString;
-          std::string s = decodeW(hex);
-          finalData.assign(s.begin(), s.end());
-        } else if (cType == 11)
-          t = RegistryType::Qword;
-        else
-          t = RegistryType::Custom;
-      }
-      auto rv = RegistryValue{"", t, finalData};
-      if (t == RegistryType::Custom)
+      if (!parseNumber(pref.substr(4, pref.size() - 5), cType, 16))
+        return std::nullopt;
+      if (cType == 1)
+        rv.type = RegistryType::String;
+      else if (cType == 2 || cType == 6 || cType == 7) {
+        RegistryType t = cType == 2   ? RegistryType::ExpandString
+                         : cType == 6 ? RegistryType::Link
+                                      : RegistryType::MultiString;
+        std::string s;
+        if (decodeW(rv.data, cType == 7, s))
+          return setString(t, s);
+        // Kept as raw bytes, which write back unchanged.
+        rv.type = RegistryType::Custom;
         rv.customType = cType;
-      return rv;
-    }
-    if (pref == "str(2)") {
-      std::string s = unquote(dat);
-      return RegistryValue{
-          "", RegistryType::ExpandString, {s.begin(), s.end()}};
-    }
-    if (pref == "str(7)") {
-      std::string s = unquote(dat);
-      return RegistryValue{"", RegistryType::MultiString, {s.begin(), s.end()}};
+      } else if (cType == 11)
+        rv.type = RegistryType::Qword;
+      else {
+        rv.type = RegistryType::Custom;
+        rv.customType = cType;
+      }
     }
-  } catch (...) {
+    return rv;
   }
+  if (pref == "str(2)")
+    return setString(RegistryType::ExpandString, unquote(dat));
+  if (pref == "str(7)")
+    return setString(RegistryType::MultiString, unquote(dat));
   return std::nullopt;
 }
 
 bool RegistryKey::load(std::istream &is) {
-  std::string line;
-  if (!std::getline(is, line))
+  std::string buf{std::istreambuf_iterator<char>(is),
+                  std::istreambuf_iterator<char>()};
+  return load(std::string_view(buf));
+}
+
+// Tokenizes the hive in place. Lines are string_views into `buf`; strings are
+// only materialized for key paths and for the final RegistryValue contents.
+bool RegistryKey::load(std::string_view buf) {
+  if (buf.empty())
     return false;
-  RegistryKey *sub = nullptr;
-  while (std::getline(is, line)) {
-    if (line.empty())
-      continue;
+  size_t nl = buf.find('\n');
+  return loadSections(nl == std::string_view::npos ? std::string_view{}
+                                                   : buf.substr(nl + 1));
+}
 
-    while (!line.empty()) {
-      size_t last = line.find_last_not_of(" \t\r\n");
-      if (last != std::string::npos && line[last] == '\\') {
-        line.erase(last);
-        std::string next;
-        if (std::getline(is, next)) {
-          size_t first = next.find_first_not_of(" \t");
-          if (first != std::string::npos)
-            line += next.substr(first);
-        } else
-          break;
-      } else
-        break;
+bool RegistryKey::loadSections(std::string_view buf) {
+  return parseSections(buf, false);
+}
+
+bool RegistryKey::parseSections(std::string_view buf, bool track) {
+  size_t pos = 0;
+
+  // Loading reflects what is already on disk, so it does not dirty the tree.
+  RegistryKey *treeRoot = root();
+  if (!track)
+    treeRoot->loading_ = true;
+
+  auto nextLine = [&]() {
+    size_t end = buf.find('\n', pos);
+    if (end == std::string_view::npos)
+      end = buf.size();
+    std::string_view l = buf.substr(pos, end - pos);
+    pos = std::min(end + 1, buf.size());
+    return l;
+  };
+  auto continues = [](std::string_view l) {
+    size_t last = l.find_last_not_of(" \t\r");
+    return last != std::string_view::npos && l[last] == '\\';
+  };
+
+  RegistryKey *sub = nullptr;
+  std::string joined;
+  while (pos < buf.size()) {
+    std::string_view line = nextLine();
+    bool wrapped = false;
+    if (continues(line)) {
+      // Wrapped hex data is parsed straight from the mapped span; the rare
+      // wrapped non-hex line is stitched into a reused scratch buffer.
+      const char *start = line.data();
+      std::string_view last = line;
+      while (continues(last) && pos < buf.size())
+        last = nextLine();
+      line = std::string_view(start, last.data() + last.size() - start);
+      wrapped = true;
     }
 
-    size_t st = line.find_first_not_of(" \t");
-    if (st == std::string::npos)
+    line = trimView(line);
+    if (line.empty())
       continue;
-    char f = line[st];
+    char f = line[0];
     if (f == ';')
       continue;
     if (f == '#') {
-      if (line.substr(st).find("#time=") == 0) {
-        try {
-          uint64_t t = std::stoull(line.substr(st + 6), nullptr, 16);
+      if (line.substr(0, 6) == "#time=") {
+        uint64_t t = 0;
+        if (parseNumber(line.substr(6), t, 16)) {
           if (sub)
             sub->modified = t;
           else
             this->modified = t;
-        } catch (...) {
         }
-      } else if (line.substr(st).find("#link") == 0) {
+      } else if (line.substr(0, 5) == "#link") {
         if (sub)
           sub->isLink = true;
       }
       continue;
     }
     if (f == '[') {
-      size_t end = line.find(']', st);
-      if (end == std::string::npos)
+      size_t end = line.find(']');
+      if (end == std::string_view::npos)
         continue;
-      std::string p = unescape(line.substr(st + 1, end - st - 1));
-      if (p.find("-") == 0) {
+      std::string p = unescape(line.substr(1, end - 1));
+      if (!p.empty() && p[0] == '-') {
         deleteKey(p.substr(1));
         sub = nullptr;
       } else {
         sub = add(p);
-        RegistryKey *temp = sub;
-        while (temp) {
+        for (RegistryKey *temp = sub; temp; temp = temp->parent)
           temp->wasInFile = true;
-          temp = temp->parent;
-        }
-        try {
-          size_t ts_pos = line.find(' ', end);
-          if (ts_pos != std::string::npos)
-            sub->unixTime = std::stoul(line.substr(ts_pos + 1));
-        } catch (...) {
+        size_t ts = line.find(' ', end);
+        if (ts != std::string_view::npos) {
+          uint32_t t = 0;
+          if (parseNumber(line.substr(ts + 1), t, 10))
+            sub->unixTime = t;
         }
       }
       continue;
@@ -395,193 +1061,755 @@ bool RegistryKey::load(std::istream &is) {
     if (f == '"' || f == '@') {
       if (!sub)
         continue;
-      size_t eq = line.find('=', st);
-      if (eq == std::string::npos)
+      size_t eq;
+      if (f == '"') {
+        size_t i = 1;
+        while (i < line.size() && line[i] != '"')
+          i += (line[i] == '\\') ? 2 : 1;
+        eq = line.find('=', std::min(i, line.size()));
+      } else
+        eq = line.find('=');
+      if (eq == std::string_view::npos)
         continue;
-      std::string vn = line.substr(st, eq - st);
-      if (vn == "@")
-        vn = "";
-      else if (vn.size() >= 2 && vn[0] == '"')
-        vn = unquote(vn);
-      std::string dataPart = line.substr(eq + 1);
+      std::string_view rawName = trimView(line.substr(0, eq));
+      std::string vn;
+      if (rawName != "@")
+        vn = (rawName.size() >= 2 && rawName[0] == '"') ? unquote(rawName)
+                                                        : std::string(rawName);
+      std::string_view dataPart = trimView(line.substr(eq + 1));
       if (dataPart == "-") {
         sub->deleteValue(vn);
-      } else {
-        auto v = parseData(dataPart);
-        if (v) {
-          sub->setValue(vn, v->type, v->data, v->customType);
-          sub->wasInFile = true;
+        continue;
+      }
+      if (wrapped && dataPart.substr(0, 3) != "hex") {
+        joined.clear();
+        size_t lp = 0;
+        while (lp < dataPart.size()) {
+          size_t nl = dataPart.find('\n', lp);
+          std::string_view seg = dataPart.substr(
+              lp, nl == std::string_view::npos ? std::string_view::npos
+                                               : nl - lp);
+          if (lp != 0)
+            seg = seg.substr(std::min(seg.find_first_not_of(" \t"), seg.size()));
+          if (continues(seg))
+            seg = seg.substr(0, seg.find_last_not_of(" \t\r"));
+          joined.append(seg);
+          if (nl == std::string_view::npos)
+            break;
+          lp = nl + 1;
         }
+        dataPart = joined;
+      }
+      if (auto v = parseData(dataPart)) {
+        v->name = vn;
+        sub->putValue(std::move(*v));
       }
     }
   }
+  treeRoot->loading_ = false;
   return true;
 }
 
 bool RegistryKey::save(std::ostream &os, const std::string &root) {
-  bool hasSomething = !values.empty() || modified || isLink || wasInFile;
-  if (hasSomething && !root.empty()) {
-    os << "[" << escape(root) << "] " << (unixTime ? unixTime : 1700000000)
-       << "\n";
-    if (modified)
-      os << "#time=" << std::hex << modified << std::dec << "\n";
-    if (isLink)
-      os << "#link\n";
-    for (const auto &v : values) {
-      if (v.name.empty())
-        os << "@=";
-      else
-        os << "\"" << escape(v.name) << "\"=";
-      std::string s(v.data.begin(), v.data.end());
-      while (!s.empty() && s.back() == 0)
-        s.pop_back();
-      switch (v.type) {
-      case RegistryType::String:
-        os << "\"" << escape(s) << "\"\n";
-        break;
-      case RegistryType::Dword:
-        os << "dword:" << std::hex << std::setw(8) << std::setfill('0')
-           << v.asDword() << std::dec << "\n";
-        break;
-      case RegistryType::ExpandString:
-        os << "str(2):\"" << escape(s) << "\"\n";
-        break;
-      case RegistryType::MultiString:
-        os << "str(7):\"" << escape(s) << "\"\n";
-        break;
-      case RegistryType::Link:
-        os << "hex(6):" << to_hex_wrapped(to_utf16(s), 7) << "\n";
-        break;
-      case RegistryType::Binary:
-        os << "hex:" << to_hex_wrapped(v.data, 4) << "\n";
-        break;
-      default:
-        os << "hex(" << std::hex
-           << (v.type == RegistryType::Custom ? v.customType
-                                              : static_cast<int>(v.type))
-           << "):" << to_hex_wrapped(v.data, 10) << std::dec << "\n";
-        break;
-      }
+  std::string out;
+  save(out, root);
+  os.write(out.data(), static_cast<std::streamsize>(out.size()));
+  return static_cast<bool>(os);
+}
+
+void RegistryKey::save(std::string &out, const std::string &root) {
+  std::string path = escape(root);
+  saveTree(out, path);
+}
+
+void RegistryKey::saveSection(std::string &out, const std::string &path) {
+  writeSection(out, escape(path));
+}
+
+// path holds this key's escaped path and is extended in place for each
+// child, so a whole hive is written without per-key path strings.
+void RegistryKey::saveTree(std::string &out, std::string &path) {
+  if (!path.empty())
+    writeSection(out, path);
+  // Wine writes siblings in case-insensitive order. Loaded hives are
+  // already in that order, so this is a linear check; a tree that was
+  // built out of order is sorted in place once and stays sorted.
+  auto less = [](const RegistryKey *a, const RegistryKey *b) {
+    return strcasecmp(a->name.c_str(), b->name.c_str()) < 0;
+  };
+  if (!std::is_sorted(subkeys.begin(), subkeys.end(), less))
+    std::sort(subkeys.begin(), subkeys.end(), less);
+  size_t len = path.size();
+  for (RegistryKey *sk : subkeys) {
+    if (len)
+      path += "\\\\";
+    appendEscaped(path, sk->name);
+    sk->saveTree(out, path);
+    path.resize(len);
+  }
+}
+
+// One `"name"=data` line. Wine's hive keeps expandable and multi strings
+// readable as str(2)/str(7); regedit only knows them as UTF-16LE hex(2)/hex(7).
+static void appendValueLine(std::string &out, const RegistryValue &v,
+                            bool regedit) {
+  if (v.name.empty())
+    out += "@=";
+  else {
+    out += '"';
+    appendEscaped(out, v.name);
+    out += "\"=";
+  }
+  std::string_view s(reinterpret_cast<const char *>(v.data.data()),
+                     v.data.size());
+  while (!s.empty() && s.back() == 0)
+    s.remove_suffix(1);
+  switch (v.type) {
+  case RegistryType::String:
+    out += '"';
+    appendEscaped(out, s);
+    out += '"';
+    break;
+  case RegistryType::Dword:
+    out += "dword:";
+    appendNumber(out, v.asDword(), 16, 8);
+    break;
+  case RegistryType::ExpandString:
+  case RegistryType::MultiString:
+    if (regedit) {
+      bool multi = v.type == RegistryType::MultiString;
+      out += multi ? "hex(7):" : "hex(2):";
+      std::vector<uint8_t> w = to_utf16(std::string(s));
+      if (multi)
+        w.insert(w.end(), {0, 0});
+      appendHexWrapped(out, w, 7);
+      break;
     }
-    os << "\n";
+    out += v.type == RegistryType::ExpandString ? "str(2):\"" : "str(7):\"";
+    appendEscaped(out, s);
+    out += '"';
+    break;
+  case RegistryType::Link:
+    out += "hex(6):";
+    appendHexWrapped(out, to_utf16(std::string(s)), 7);
+    break;
+  case RegistryType::Binary:
+    out += "hex:";
+    appendHexWrapped(out, v.data, 4);
+    break;
+  default:
+    out += "hex(";
+    appendNumber(out,
+                 v.type == RegistryType::Custom
+                     ? v.customType
+                     : static_cast<uint32_t>(v.type),
+                 16);
+    out += "):";
+    appendHexWrapped(out, v.data, 10);
+    break;
+  }
+  out += '\n';
+}
+
+void RegistryKey::writeSection(std::string &out, std::string_view path) {
+  if (values.empty() && !modified && !isLink && !wasInFile)
+    return;
+  out += '[';
+  out += path;
+  out += "] ";
+  appendNumber(out, unixTime ? unixTime : 1700000000u, 10);
+  out += '\n';
+  if (modified) {
+    out += "#time=";
+    appendNumber(out, modified, 16);
+    out += '\n';
+  }
+  if (isLink)
+    out += "#link\n";
+  for (const auto &v : values)
+    appendValueLine(out, v, false);
+  out += '\n';
+}
+
+void RegistryKey::exportReg(const std::string &keyPath,
+                            const std::function<void(std::string_view)> &sink) {
+  std::string path = keyPath;
+  std::string out;
+  exportTree(path, out, sink);
+  if (!out.empty())
+    sink(out);
+}
+
+// Like saveTree, but every key gets a section, paths are not escaped and
+// the text is handed to sink in pieces of about kExportChunk bytes.
+void RegistryKey::exportTree(
+    std::string &path, std::string &out,
+    const std::function<void(std::string_view)> &sink) {
+  constexpr size_t kExportChunk = 64 << 10;
+  out += '[';
+  out += path;
+  out += "]\n";
+  for (const auto &v : values)
+    appendValueLine(out, v, true);
+  out += '\n';
+  if (out.size() >= kExportChunk) {
+    sink(out);
+    out.clear();
   }
-  std::vector<std::shared_ptr<RegistryKey>> sorted = subkeys;
-  std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+  auto less = [](const RegistryKey *a, const RegistryKey *b) {
     return strcasecmp(a->name.c_str(), b->name.c_str()) < 0;
-  });
-  for (auto &sk : sorted)
-    sk->save(os, root.empty() ? sk->name : root + "\\" + sk->name);
+  };
+  if (!std::is_sorted(subkeys.begin(), subkeys.end(), less))
+    std::sort(subkeys.begin(), subkeys.end(), less);
+  size_t len = path.size();
+  for (RegistryKey *sk : subkeys) {
+    path += '\\';
+    path += sk->name;
+    sk->exportTree(path, out, sink);
+    path.resize(len);
+  }
+}
+
+RegistryArena::RegistryArena(size_t sizeHint)
+    : pool_(std::max<size_t>(sizeHint, 64 * 1024), &upstream_),
+      root_(std::pmr::polymorphic_allocator<>(&pool_).new_object<RegistryKey>()) {
+}
+
+RegistryArena::~RegistryArena() = default;
+
+void *RegistryArena::Upstream::do_allocate(size_t n, size_t align) {
+  void *p = std::pmr::new_delete_resource()->allocate(n, align);
+  bytes += n;
+  return p;
+}
+
+void RegistryArena::Upstream::do_deallocate(void *p, size_t n, size_t align) {
+  bytes -= n;
+  std::pmr::new_delete_resource()->deallocate(p, n, align);
+}
+
+size_t RegistryArena::footprint() const {
+  size_t n = upstream_.bytes;
+  for (const auto &part : parts_)
+    n += part->footprint();
+  return n;
+}
+
+// Below this much dead weight a compacting copy is not worth its cost.
+static constexpr size_t kChurnSlack = 4 << 20;
+
+bool RegistryArena::churned() const {
+  return baseline_ && footprint() > 2 * baseline_ + kChurnSlack;
+}
+
+std::shared_ptr<RegistryArena> RegistryArena::clone() const {
+  auto copy = std::make_shared<RegistryArena>();
+  copy->root_->cloneFrom(*root_);
+  if (lazy)
+    copy->lazy = std::make_unique<LazyHive>(*lazy);
+  copy->settle();
+  return copy;
+}
+
+// Deleter of a pin handle: the handle aliases the arena and owns a
+// reference to it; dropping the last copy unpins it.
+struct RegistryArena::Unpin {
+  std::shared_ptr<RegistryArena> keep;
+  void operator()(RegistryArena *a) const {
+    a->pins_.fetch_sub(1, std::memory_order_acq_rel);
+  }
+};
+
+std::shared_ptr<RegistryArena>
+RegistryArena::pin(const std::shared_ptr<RegistryArena> &arena) {
+  if (!arena)
+    return nullptr;
+  arena->pins_.fetch_add(1, std::memory_order_acq_rel);
+  return std::shared_ptr<RegistryArena>(arena.get(), Unpin{arena});
+}
+
+std::shared_ptr<RegistryArena>
+RegistryArena::unpinned(const std::shared_ptr<RegistryArena> &handle) {
+  if (auto *d = std::get_deleter<Unpin>(handle))
+    return d->keep;
+  return handle;
+}
+
+// Each parse worker gets at least this much text; below that the split and
+// merge cost more than the parallel parse saves.
+static constexpr size_t kParseChunkMin = 4 << 20;
+static constexpr unsigned kMaxParseThreads = 8;
+
+bool RegistryArena::load(std::string_view buf) {
+  if (buf.empty())
+    return false;
+  size_t nl = buf.find('\n');
+  std::string_view body =
+      nl == std::string_view::npos ? std::string_view{} : buf.substr(nl + 1);
+
+  size_t n = std::min(std::thread::hardware_concurrency(), kMaxParseThreads);
+  n = std::min(n, body.size() / kParseChunkMin);
+  // A [-key] deletion must see every section before it, which chunks
+  // parsed side by side cannot guarantee. Wine never writes them, but
+  // hand-edited hives may.
+  if (n < 2 || memmem(body.data(), body.size(), "\n[-", 3))
+    return root_->loadSections(body);
+
+  // Split at section headers so every chunk is a self-contained run of
+  // sections, parse each into its own arena, then merge them in file order.
+  std::vector<std::string_view> chunks;
+  size_t pos = 0;
+  for (size_t i = 1; i < n && pos < body.size(); ++i) {
+    size_t at = body.find('\n', std::max(pos, i * body.size() / n));
+    at = (at == std::string_view::npos) ? body.size()
+                                        : nextSection(body, at + 1);
+    chunks.push_back(body.substr(pos, at - pos));
+    pos = at;
+  }
+  chunks.push_back(body.substr(pos));
+
+  std::vector<std::unique_ptr<RegistryArena>> parts;
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < chunks.size(); ++i) {
+    parts.push_back(std::make_unique<RegistryArena>(chunks[i].size() +
+                                                    chunks[i].size() / 2));
+    workers.emplace_back([part = parts.back().get(), chunk = chunks[i]] {
+      part->root()->loadSections(chunk);
+    });
+  }
+  root_->loadSections(chunks[0]);
+  for (auto &w : workers)
+    w.join();
+
+  root_->loading_ = true;
+  for (auto &part : parts)
+    root_->absorb(*part->root());
+  root_->loading_ = false;
+  // Relinked keys still live in the part arenas.
+  for (auto &part : parts)
+    parts_.push_back(std::move(part));
   return true;
 }
 
-Registry::Registry(const std::string &p)
-    : prefixDir_(p), lastSystem_(std::filesystem::file_time_type::min()),
-      lastUser_(std::filesystem::file_time_type::min()) {
-  loadHive("system.reg", machine_);
+// Watches one prefix directory for rewrites of its hives. Every Registry
+// opened on the directory shares the instance. A thread blocks on inotify
+// and bumps a per-hive generation each time the file is closed after
+// writing, renamed into place or deleted, so Registry operations only go
+// back to the filesystem when a generation moved.
+class HiveWatcher {
+public:
+  enum Hive { System, User };
+
+  static std::shared_ptr<HiveWatcher> forDirectory(const std::string &dir) {
+    static std::mutex mtx;
+    static std::map<std::string, std::weak_ptr<HiveWatcher>> watchers;
+    std::error_code ec;
+    std::string key = fs::weakly_canonical(dir, ec).string();
+    if (ec)
+      key = dir;
+    std::lock_guard lock(mtx);
+    if (auto w = watchers[key].lock())
+      return w;
+    auto w = std::make_shared<HiveWatcher>(key);
+    watchers[key] = w;
+    return w;
+  }
+
+  explicit HiveWatcher(const std::string &dir) {
+    inotify_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    wake_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inotify_ < 0 || wake_ < 0 ||
+        inotify_add_watch(inotify_, dir.c_str(),
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE |
+                              IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+      LOG_WARN("inotify unavailable for %s, polling hive mtimes",
+               dir.c_str());
+      return;
+    }
+    live_ = true;
+    thread_ = std::thread([this] { run(); });
+  }
+
+  ~HiveWatcher() {
+    if (thread_.joinable()) {
+      uint64_t one = 1;
+      [[maybe_unused]] ssize_t n = ::write(wake_, &one, sizeof(one));
+      thread_.join();
+    }
+    if (inotify_ >= 0)
+      ::close(inotify_);
+    if (wake_ >= 0)
+      ::close(wake_);
+  }
+
+  HiveWatcher(const HiveWatcher &) = delete;
+  HiveWatcher &operator=(const HiveWatcher &) = delete;
+
+  // False once the watch is gone (or never existed); callers then have to
+  // stat the hives themselves.
+  bool live() const { return live_.load(std::memory_order_acquire); }
+  uint64_t generation(Hive h) const {
+    return generation_[h].load(std::memory_order_acquire);
+  }
+
+private:
+  int inotify_ = -1;
+  int wake_ = -1;
+  std::atomic<bool> live_{false};
+  std::atomic<uint64_t> generation_[2] = {0, 0};
+  std::thread thread_;
+
+  void run() {
+    alignas(inotify_event) char buf[4096];
+    pollfd fds[2] = {{inotify_, POLLIN, 0}, {wake_, POLLIN, 0}};
+    while (true) {
+      if (poll(fds, 2, -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      if (fds[1].revents)
+        return;
+      ssize_t len;
+      while ((len = ::read(inotify_, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len;) {
+          auto *ev = reinterpret_cast<inotify_event *>(p);
+          p += sizeof(inotify_event) + ev->len;
+          if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED |
+                          IN_Q_OVERFLOW)) {
+            // Events may have been lost; fall back to stat from here on.
+            live_.store(false, std::memory_order_release);
+            return;
+          }
+          std::string_view name(ev->len ? ev->name : "");
+          if (name == "system.reg")
+            generation_[System].fetch_add(1, std::memory_order_release);
+          else if (name == "user.reg")
+            generation_[User].fetch_add(1, std::memory_order_release);
+        }
+      }
+    }
+    live_.store(false, std::memory_order_release);
+  }
+};
+
+// Locks mutex_ for one public call, unless the calling thread already holds
+// it through a Transaction: locking again would deadlock, so the call runs
+// under that hold and marks the transactions' key caches stale.
+class Registry::Guard {
+public:
+  explicit Guard(const Registry &reg, bool shared = false) {
+    if (reg.txnOwner_.load(std::memory_order_relaxed) ==
+        std::this_thread::get_id())
+      ++reg.txnEpoch_;
+    else if (shared)
+      shared_ = std::shared_lock(reg.mutex_);
+    else
+      unique_ = std::unique_lock(reg.mutex_);
+  }
+
+private:
+  std::unique_lock<std::shared_mutex> unique_;
+  std::shared_lock<std::shared_mutex> shared_;
+};
+
+Registry::Registry(const std::string &p, LoadMode mode)
+    : prefixDir_(p), mode_(mode) {
+  // Watch before loading so a rewrite racing the load is not missed.
+  watcher_ = HiveWatcher::forDirectory(p);
+  // The hives are independent files and trees, so system.reg, usually the
+  // larger one, loads on a second thread while user.reg loads here.
+  std::thread system([this] { loadHive("system.reg", machine_); });
   loadHive("user.reg", currentUser_);
+  system.join();
 }
 
 Registry::~Registry() { commit(); }
 
+std::shared_ptr<RegistryKey> Registry::getCurrentUser() {
+  Guard l(*this);
+  if (!currentUser_)
+    return nullptr;
+  // Callers may edit the tree in place.
+  detach(currentUser_);
+  materialize(currentUser_, "", true);
+  return std::shared_ptr<RegistryKey>(currentUser_, currentUser_->root());
+}
+
+bool Registry::hivesChanged() const {
+  return !watcher_->live() ||
+         watcher_->generation(HiveWatcher::System) != seenSystem_ ||
+         watcher_->generation(HiveWatcher::User) != seenUser_;
+}
+
 void Registry::checkAndReload() {
+  if (!hivesChanged())
+    return;
+  // Snapshot the generations first: a rewrite that lands while the hives
+  // are being checked bumps them again and is picked up next time.
+  seenSystem_ = watcher_->generation(HiveWatcher::System);
+  seenUser_ = watcher_->generation(HiveWatcher::User);
+  // Compared by identity rather than "newer mtime": a hive renamed over
+  // ours within the filesystem's timestamp granularity still differs in
+  // inode.
+  struct stat st {};
   auto ps = fs::path(prefixDir_) / "system.reg";
+  if (::stat(ps.c_str(), &st) == 0 && !(HiveStamp(st) == lastSystem_))
+    loadHive("system.reg", machine_);
   auto pu = fs::path(prefixDir_) / "user.reg";
-  if (fs::exists(ps)) {
-    auto m = fs::last_write_time(ps);
-    if (m > lastSystem_) {
-      loadHive("system.reg", machine_);
-      lastSystem_ = m;
-    }
-  }
-  if (fs::exists(pu)) {
-    auto m = fs::last_write_time(pu);
-    if (m > lastUser_) {
-      loadHive("user.reg", currentUser_);
-      lastUser_ = m;
-    }
-  }
+  if (::stat(pu.c_str(), &st) == 0 && !(HiveStamp(st) == lastUser_))
+    loadHive("user.reg", currentUser_);
 }
 
-bool Registry::loadHive(const std::string &f, std::shared_ptr<RegistryKey> &k) {
+bool Registry::loadHive(const std::string &f,
+                        std::shared_ptr<RegistryArena> &hive) {
   fs::path p = fs::path(prefixDir_) / f;
-  if (!fs::exists(p))
-    return false;
-  std::ifstream is(p);
-  if (!is.is_open())
+  MappedFile mf(p);
+  if (!mf.ok)
     return false;
-  std::string firstLine;
-  if (std::getline(is, firstLine)) {
-    std::string secondLine;
-    if (std::getline(is, secondLine) &&
-        secondLine.find(";; All keys relative to ") == 0) {
-      std::string rel = secondLine.substr(24);
-      if (f == "system.reg")
-        systemRelativePath_ = rel;
-      else
-        userRelativePath_ = rel;
-    }
-    is.seekg(0);
-    auto nk = std::make_shared<RegistryKey>();
-    if (nk->load(is)) {
-      k = nk;
-      LOG_INFO("Loaded hive %s: %zu subkeys", f.c_str(), k->subkeys.size());
-      return true;
-    }
+  HiveStamp stamp(mf.st);
+  (f == "system.reg" ? lastSystem_ : lastUser_) = stamp;
+  (f == "system.reg" ? revertedSystem_ : revertedUser_) = false;
+  std::string &relativePath =
+      (f == "system.reg") ? systemRelativePath_ : userRelativePath_;
+  if (mode_ == LoadMode::Eager &&
+      loadHiveCache(p, stamp, hive, relativePath)) {
+    LOG_INFO("Loaded hive %s from cache: %zu subkeys", f.c_str(),
+             hive->root()->subkeys.size());
+    return true;
+  }
+  std::string_view buf = mf.view();
+  size_t nl = buf.find('\n');
+  if (nl != std::string_view::npos) {
+    std::string_view second = buf.substr(nl + 1);
+    second = second.substr(0, second.find('\n'));
+    constexpr std::string_view marker = ";; All keys relative to ";
+    if (second.substr(0, marker.size()) == marker)
+      relativePath = std::string(trimView(second.substr(marker.size())));
+  }
+  if (mode_ == LoadMode::Lazy) {
+    auto arena = std::make_shared<RegistryArena>();
+    arena->lazy = std::make_unique<LazyHive>(p);
+    if (!arena->lazy->file->ok)
+      return false;
+    arena->lazy->index();
+    hive = std::move(arena);
+    LOG_INFO("Indexed hive %s: %zu sections", f.c_str(),
+             hive->lazy->sections.size());
+    return true;
+  }
+  // Parsed trees run roughly 1.5x the text size; size the first arena block
+  // so a typical hive lands in one or two contiguous buffers.
+  auto arena = std::make_shared<RegistryArena>(buf.size() + buf.size() / 2);
+  if (arena->load(buf)) {
+    arena->settle();
+    hive = std::move(arena);
+    LOG_INFO("Loaded hive %s: %zu subkeys", f.c_str(),
+             hive->root()->subkeys.size());
+    writeHiveCache(p, stamp, *hive, relativePath);
+    return true;
   }
   return false;
 }
 
-bool Registry::saveHive(const std::string &f, std::shared_ptr<RegistryKey> &k,
+bool Registry::saveHive(const std::string &f,
+                        std::shared_ptr<RegistryArena> &hive,
                         const std::string &r) {
-  if (!k)
+  if (!hive)
     return true;
+  // Saving sorts children in place and resets dirty state.
+  detach(hive);
+  // Deleted and replaced nodes are never freed from the arena; once they
+  // outweigh the live tree, carry on in a compact copy. Lazy hives grow
+  // by parsing, not churn, and are left alone.
+  if (!hive->lazy && hive->churned()) {
+    LOG_DEBUG("Compacting %s: %zu KB arena", f.c_str(), hive->footprint() >> 10);
+    hive = hive->clone();
+  }
   fs::path p = fs::path(prefixDir_) / f;
-  fs::path p_tmp = p;
-  p_tmp += ".tmp";
-  std::ofstream os(p_tmp, std::ios::trunc);
-  if (!os.is_open())
-    return false;
-  os << "WINE REGISTRY Version 2\n;; All keys relative to " << r
-     << "\n\n#arch=win64\n\n";
-  k->save(os, "");
-  os.close();
-  try {
-    fs::rename(p_tmp, p);
-  } catch (...) {
+  std::string &out = saveBuffer_;
+  out.clear();
+  if (hive->lazy)
+    saveLazy(out, *hive);
+  else {
+    out += "WINE REGISTRY Version 2\n;; All keys relative to ";
+    out += r;
+    out += "\n\n#arch=win64\n\n";
+    hive->root()->save(out, "");
+  }
+  if (!writeFileAtomic(p, out, true)) {
+    LOG_ERROR("Failed to write %s: %s", p.c_str(), strerror(errno));
     return false;
   }
-  if (f == "system.reg")
-    lastSystem_ = fs::last_write_time(p);
-  else
-    lastUser_ = fs::last_write_time(p);
+  hive->root()->clearDirty();
+  (f == "system.reg" ? revertedSystem_ : revertedUser_) = false;
+  struct stat st {};
+  if (::stat(p.c_str(), &st) == 0)
+    (f == "system.reg" ? lastSystem_ : lastUser_) = HiveStamp(st);
+  // The cache no longer matches the file. Rebuilding it here would
+  // serialize and write the whole tree a second time on every small edit;
+  // the next cold load from text writes a fresh one instead.
+  unlink(cachePath(p).c_str());
   return true;
 }
 
-RegistryKey *Registry::getRoot(const std::string &p, std::string &s) {
-  size_t i = p.find('\\');
-  std::string r = (i == std::string::npos) ? p : p.substr(0, i);
-  s = (i == std::string::npos) ? "" : p.substr(i + 1);
-  std::transform(r.begin(), r.end(), r.begin(), ::toupper);
-  if (r == "HKLM" || r == "HKEY_LOCAL_MACHINE") {
-    if (!machine_)
-      machine_ = std::make_shared<RegistryKey>("HKLM");
-    return machine_.get();
+// Writes a lazily loaded hive in its original section order. Sections that
+// were never parsed, or were parsed but not modified since, are copied from
+// the mapping byte for byte; keys created since load are appended.
+void Registry::saveLazy(std::string &out, RegistryArena &hive) {
+  LazyHive &lz = *hive.lazy;
+  RegistryKey *root = hive.root();
+  out += lz.preamble;
+  std::unordered_set<const RegistryKey *> written;
+  for (auto &sec : lz.sections) {
+    if (!sec.loaded) {
+      out += sec.raw;
+      continue;
+    }
+    RegistryKey *k = root->query(root->unescape(sec.path));
+    if (!k)
+      continue;
+    if (!sec.rewritten && !k->isDirty()) {
+      out += sec.raw;
+      continue;
+    }
+    sec.rewritten = true;
+    if (written.insert(k).second)
+      k->writeSection(out, sec.path);
   }
-  if (r == "HKCU" || r == "HKEY_CURRENT_USER") {
-    if (!currentUser_)
-      currentUser_ = std::make_shared<RegistryKey>("HKCU");
-    return currentUser_.get();
+
+  std::string path;
+  auto appendNew = [&](auto &self, RegistryKey *k) -> void {
+    size_t len = path.size();
+    for (RegistryKey *sk : k->subkeys) {
+      if (len)
+        path += "\\\\";
+      appendEscaped(path, sk->name);
+      // Ancestors that only exist in the tree because a deeper section was
+      // parsed are not written; Wine never had a section for them.
+      if (!written.count(sk) && !lz.byPath.count(path) &&
+          (sk->isDirty() || lz.appended.count(path))) {
+        sk->writeSection(out, path);
+        lz.appended.insert(path);
+      }
+      self(self, sk);
+      path.resize(len);
+    }
+  };
+  appendNew(appendNew, root);
+}
+
+// Parses the unloaded sections of a lazy hive that sit at subPath, or with
+// subtree set, at or below it. No-op for hives that were loaded eagerly.
+void Registry::materialize(std::shared_ptr<RegistryArena> &hive,
+                           const std::string &subPath, bool subtree) {
+  if (!hive || !hive->lazy)
+    return;
+  RegistryKey *root = hive->root();
+
+  // Section headers escape the separator too, so "A\\B" is written "A\\\\B".
+  std::string target;
+  size_t start = 0;
+  while (start <= subPath.size()) {
+    size_t end = subPath.find('\\', start);
+    if (end == std::string::npos)
+      end = subPath.size();
+    if (end > start) {
+      if (!target.empty())
+        target += "\\\\";
+      target +=
+          root->escape(std::string_view(subPath).substr(start, end - start));
+    }
+    start = end + 1;
+  }
+
+  std::vector<size_t> pending;
+  auto want = [&](size_t i) {
+    if (!hive->lazy->sections[i].loaded)
+      pending.push_back(i);
+  };
+  LazyHive &lz = *hive->lazy;
+  if (!subtree) {
+    auto it = lz.byPath.find(target);
+    for (size_t i = it == lz.byPath.end() ? SIZE_MAX : it->second;
+         i != SIZE_MAX; i = lz.sections[i].nextSame)
+      want(i);
+  } else {
+    CaseInsensitiveEqual eq;
+    for (size_t i = 0; i < lz.sections.size(); ++i) {
+      std::string_view p = lz.sections[i].path;
+      if (target.empty() || eq(p, target) ||
+          (p.size() > target.size() + 1 &&
+           eq(p.substr(0, target.size()), target) &&
+           p.substr(target.size(), 2) == "\\\\"))
+        want(i);
+    }
+  }
+  if (pending.empty())
+    return;
+
+  // The copy keeps the section order, so the indices still apply.
+  detach(hive);
+  for (size_t i : pending) {
+    auto &sec = hive->lazy->sections[i];
+    sec.loaded = true;
+    hive->root()->loadSections(sec.raw);
   }
+}
+
+std::shared_ptr<RegistryArena> *Registry::hiveFor(const std::string &p) {
+  std::string r = p.substr(0, p.find('\\'));
+  std::transform(r.begin(), r.end(), r.begin(), ::toupper);
+  if (r == "HKLM" || r == "HKEY_LOCAL_MACHINE")
+    return &machine_;
+  if (r == "HKCU" || r == "HKEY_CURRENT_USER")
+    return &currentUser_;
   return nullptr;
 }
 
+RegistryKey *Registry::getRoot(const std::string &p, std::string &s,
+                               bool forWrite) {
+  size_t i = p.find('\\');
+  s = (i == std::string::npos) ? "" : p.substr(i + 1);
+  auto *hive = hiveFor(p);
+  if (!hive)
+    return nullptr;
+  if (!*hive)
+    *hive = std::make_shared<RegistryArena>();
+  else if (forWrite)
+    detach(*hive);
+  return (*hive)->root();
+}
+
+void Registry::detach(std::shared_ptr<RegistryArena> &hive) {
+  if (hive && hive->pinned())
+    hive = hive->clone();
+}
+
 std::optional<std::string> Registry::query(const std::string &p,
                                            const std::string &n) {
-  std::unique_lock l(mutex_);
+  {
+    // Fast path: nothing on disk changed and the hive is fully parsed, so
+    // the lookup is read-only and concurrent readers do not serialize.
+    Guard l(*this, true);
+    auto *hive = hiveFor(p);
+    if (hive && *hive && !(*hive)->lazy && !hivesChanged()) {
+      size_t i = p.find('\\');
+      RegistryKey *k = (*hive)->root()->query(
+          i == std::string::npos ? std::string_view{}
+                                 : std::string_view(p).substr(i + 1));
+      if (auto *v = k ? k->getValue(n) : nullptr)
+        return v->asString();
+      return std::nullopt;
+    }
+  }
+  Guard l(*this);
   checkAndReload();
   std::string s;
   RegistryKey *r = getRoot(p, s);
   if (r) {
+    materialize(*hiveFor(p), s, false);
+    r = (*hiveFor(p))->root();
     if (auto *k = r->query(s)) {
       if (auto *v = k->getValue(n))
         return v->asString();
@@ -592,15 +1820,16 @@ std::optional<std::string> Registry::query(const std::string &p,
 
 void Registry::add(const std::string &p, const std::string &n,
                    const std::string &v, const std::string &t) {
-  std::unique_lock l(mutex_);
+  Guard l(*this);
   checkAndReload();
   std::string s;
-  RegistryKey *r = getRoot(p, s);
+  RegistryKey *r = getRoot(p, s, true);
   if (!r)
     return;
+  materialize(*hiveFor(p), s, false);
   RegistryKey *k = r->add(s);
   RegistryType rt = RegistryType::String;
-  std::vector<uint8_t> d;
+  std::pmr::vector<uint8_t> d;
   if (t == "REG_DWORD") {
     rt = RegistryType::Dword;
     uint32_t iv = std::stoul(v, nullptr, 0);
@@ -608,16 +1837,16 @@ void Registry::add(const std::string &p, const std::string &n,
     std::memcpy(d.data(), &iv, 4);
   } else if (t == "REG_BINARY") {
     rt = RegistryType::Binary;
-    d = parseBytes(v);
+    parseBytes(v, d);
   } else {
     d.assign(v.begin(), v.end());
   }
   k->setValue(n, rt, d);
 }
 
-void Registry::transplant(const std::string &path, Registry &source) {
-  std::unique_lock l1(mutex_);
-  std::unique_lock l2(source.mutex_);
+size_t Registry::transplant(const std::string &path, Registry &source) {
+  Guard l1(*this);
+  Guard l2(source);
   checkAndReload();
   source.checkAndReload();
 
@@ -626,21 +1855,219 @@ void Registry::transplant(const std::string &path, Registry &source) {
   RegistryKey *rSrc = source.getRoot(path, s);
 
   if (!rDest || !rSrc)
-    return;
+    return 0;
+  materialize(*hiveFor(path), s, true);
+  source.materialize(*source.hiveFor(path), s, true);
+  rDest = (*hiveFor(path))->root();
+  rSrc = (*source.hiveFor(path))->root();
 
   RegistryKey *kSrc = rSrc->query(s);
   if (!kSrc)
-    return;
+    return 0;
+
+  RegistryKey *kDest = rDest->query(s);
+  auto &hive = *hiveFor(path);
+  if (hive->pinned()) {
+    // Keep sharing the snapshot's hive when there is nothing to merge.
+    if (kDest && kDest->contentHash() == kSrc->contentHash())
+      return 0;
+    detach(hive);
+    kDest = hive->root()->query(s);
+  }
+
+  size_t changes = 0;
+  if (!kDest) {
+    kDest = hive->root()->add(s);
+    ++changes;
+  }
+  return changes + kDest->mergeFrom(*kSrc);
+}
 
-  RegistryKey *kDest = rDest->add(s);
-  kDest->copyFrom(*kSrc);
+static size_t hiveDirtyCount(const std::shared_ptr<RegistryArena> &hive) {
+  return hive ? hive->root()->dirtyCount() : 0;
 }
 
 bool Registry::commit() {
-  std::unique_lock l(mutex_);
-  saveHive("system.reg", machine_, systemRelativePath_);
-  saveHive("user.reg", currentUser_, userRelativePath_);
+  Guard l(*this);
+  return commitLocked();
+}
+
+bool Registry::commitLocked() {
+  size_t sys = hiveDirtyCount(machine_);
+  size_t usr = hiveDirtyCount(currentUser_);
+  if (sys == 0 && usr == 0 && !revertedSystem_ && !revertedUser_)
+    return true;
+  LOG_DEBUG("Committing registry: %zu system / %zu user keys dirty", sys, usr);
+  bool ok = true;
+  if (sys || revertedSystem_)
+    ok &= saveHive("system.reg", machine_, systemRelativePath_);
+  if (usr || revertedUser_)
+    ok &= saveHive("user.reg", currentUser_, userRelativePath_);
+  return ok;
+}
+
+Registry::Transaction::Transaction(Registry &reg) : reg_(reg) {
+  // A transaction opened inside another on the same thread shares its hold.
+  if (reg_.txnOwner_.load(std::memory_order_relaxed) !=
+      std::this_thread::get_id()) {
+    lock_ = std::unique_lock(reg_.mutex_);
+    reg_.txnOwner_.store(std::this_thread::get_id(),
+                         std::memory_order_relaxed);
+  }
+  // A reload swaps hives under any outer transaction's cached keys.
+  reg_.checkAndReload();
+  bumpEpoch();
+}
+
+Registry::Transaction::~Transaction() {
+  // Cleared before lock_ is released by its own destructor.
+  if (lock_.owns_lock())
+    reg_.txnOwner_.store(std::thread::id(), std::memory_order_relaxed);
+}
+
+void Registry::Transaction::invalidateIfStale() {
+  if (epoch_ != reg_.txnEpoch_)
+    keys_.clear();
+}
+
+void Registry::Transaction::bumpEpoch() { epoch_ = ++reg_.txnEpoch_; }
+
+RegistryKey *Registry::Transaction::key(const std::string &path) {
+  invalidateIfStale();
+  auto it = keys_.find(path);
+  if (it != keys_.end())
+    return it->second;
+  // Detaching from a snapshot happens here, before the pointer is cached.
+  // Only this thread can pin the hive again while the lock is held, and
+  // doing so goes through a Guard, which empties keys_ on the next call.
+  std::string s;
+  RegistryKey *k = reg_.getRoot(path, s, true);
+  if (k) {
+    reg_.materialize(*reg_.hiveFor(path), s, false);
+    k = k->add(s);
+  }
+  bumpEpoch();
+  keys_.emplace(path, k);
+  return k;
+}
+
+Registry::Transaction &
+Registry::Transaction::setString(const std::string &path, std::string_view name,
+                                 std::string_view value, RegistryType type) {
+  if (RegistryKey *k = key(path))
+    k->setValue(
+        name, type,
+        {reinterpret_cast<const uint8_t *>(value.data()), value.size()});
+  return *this;
+}
+
+Registry::Transaction &
+Registry::Transaction::setDword(const std::string &path, std::string_view name,
+                                uint32_t value) {
+  if (RegistryKey *k = key(path)) {
+    uint8_t d[4];
+    std::memcpy(d, &value, 4);
+    k->setValue(name, RegistryType::Dword, d);
+  }
+  return *this;
+}
+
+Registry::Transaction &
+Registry::Transaction::setBinary(const std::string &path, std::string_view name,
+                                 std::span<const uint8_t> data) {
+  if (RegistryKey *k = key(path))
+    k->setValue(name, RegistryType::Binary, data);
+  return *this;
+}
+
+bool Registry::Transaction::apply(const std::string &hive,
+                                  std::string_view sections) {
+  // Applied sections may delete keys whose pointers are cached.
+  keys_.clear();
+  bumpEpoch();
+  return reg_.applySections(hive, sections);
+}
+
+bool Registry::Transaction::commit() {
+  // A save may swap a hive for a copy (detach, compaction).
+  keys_.clear();
+  bumpEpoch();
+  return reg_.commitLocked();
+}
+
+bool Registry::applySections(const std::string &hive,
+                             std::string_view sections) {
+  std::string s;
+  RegistryKey *root = getRoot(hive, s, true);
+  if (!root || !s.empty())
+    return false;
+  auto &arena = *hiveFor(hive);
+  if (arena->lazy) {
+    // Unparsed sections are written back verbatim, so every key named here
+    // is parsed from the file first; a deleted key with its whole subtree.
+    for (size_t pos = nextSection(sections, 0); pos < sections.size();) {
+      size_t eol = sections.find('\n', pos);
+      std::string_view header = sections.substr(pos, eol - pos);
+      size_t end = header.find(']');
+      if (end != std::string_view::npos) {
+        std::string p = root->unescape(header.substr(1, end - 1));
+        bool del = !p.empty() && p[0] == '-';
+        materialize(arena, del ? p.substr(1) : p, del);
+      }
+      if (eol == std::string_view::npos)
+        break;
+      pos = nextSection(sections, eol + 1);
+    }
+  }
+  return root->parseSections(sections, true);
+}
+
+bool Registry::exportReg(const std::string &p,
+                         const std::function<void(std::string_view)> &sink) {
+  Guard l(*this);
+  checkAndReload();
+  std::string s;
+  RegistryKey *r = getRoot(p, s);
+  if (!r)
+    return false;
+  materialize(*hiveFor(p), s, true);
+  RegistryKey *k = (*hiveFor(p))->root()->query(s);
+  if (!k)
+    return false;
+  std::string full =
+      hiveFor(p) == &machine_ ? "HKEY_LOCAL_MACHINE" : "HKEY_CURRENT_USER";
+  if (!s.empty()) {
+    full += '\\';
+    full += s;
+  }
+  k->exportReg(full, sink);
   return true;
 }
 
+Registry::Snapshot Registry::snapshot() {
+  Guard l(*this);
+  checkAndReload();
+  return {RegistryArena::pin(machine_), RegistryArena::pin(currentUser_)};
+}
+
+void Registry::revert(const Snapshot &snap) {
+  Guard l(*this);
+  checkAndReload();
+  // Adopt the arenas themselves rather than the snapshot's handles, so
+  // they stop being pinned once the snapshot is gone.
+  if (snap.machine && snap.machine != machine_) {
+    machine_ = RegistryArena::unpinned(snap.machine);
+    revertedSystem_ = true;
+  }
+  if (snap.user && snap.user != currentUser_) {
+    currentUser_ = RegistryArena::unpinned(snap.user);
+    revertedUser_ = true;
+  }
+}
+
+size_t Registry::dirtyKeyCount() const {
+  Guard l(*this, true);
+  return hiveDirtyCount(machine_) + hiveDirtyCount(currentUser_);
+}
+
 } // namespace rsjfw
@@ -219,21 +219,21 @@ bool Runner::provisionCommonDependencies(ProgressCb cb) {
       fs::rename(sourceDir, targetDir);
     }
 
-    prefix_->registryAdd(
+    Registry::Transaction tx(prefix_->getRegistry());
+    tx.setString(
         "HKEY_LOCAL_MACHINE\\SOFTWARE\\Microsoft\\EdgeUpdate\\Clients\\{"
         "F3017226-FE2A-4295-8BDF-00C3A9A7E4C5}",
-        "pv", "143.0.3650.139", "REG_SZ");
-    prefix_->registryAdd(
+        "pv", "143.0.3650.139");
+    tx.setString(
         "HKEY_LOCAL_"
         "MACHINE\\SOFTWARE\\WOW6432Node\\Microsoft\\EdgeUpdate\\Clients\\{"
         "F3017226-FE2A-4295-8BDF-00C3A9A7E4C5}",
         "location",
-        "C:\\Program Files (x86)\\Microsoft\\EdgeWebView\\Application",
-        "REG_SZ");
-    prefix_->registryAdd(
+        "C:\\Program Files (x86)\\Microsoft\\EdgeWebView\\Application");
+    tx.setString(
         "HKEY_CURRENT_USER\\Software\\Wine\\AppDefaults\\msedgewebview2.exe",
-        "Version", "win7", "REG_SZ");
-    prefix_->registryCommit();
+        "Version", "win7");
+    tx.commit();
   }
 
   std::ofstream(marker) << "done";
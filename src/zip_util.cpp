@@ -1,6 +1,7 @@
 #include "zip_util.h"
 #include <archive.h>
 #include <archive_entry.h>
+#include <cerrno>
 #include <filesystem>
 #include <iostream>
 
@@ -22,27 +23,10 @@ static bool copyData(struct archive* a, struct archive* ext) {
     }
 }
 
-bool ZipUtil::extract(const std::string& archivePath,
-                      const std::string& destPath,
-                      ProgressCallback cb)
+static bool extractArchive(struct archive* a, size_t totalBytes,
+                           const std::string& destPath, ProgressCallback cb,
+                           std::vector<std::string>* files)
 {
-    namespace fs = std::filesystem;
-
-    if (!fs::exists(archivePath) || fs::file_size(archivePath) == 0)
-        return false;
-
-    size_t totalBytes = fs::file_size(archivePath);
-
-    struct archive* a = archive_read_new();
-    archive_read_support_format_all(a);
-    archive_read_support_filter_all(a);
-
-    if (archive_read_open_filename(a, archivePath.c_str(), 10240) != ARCHIVE_OK) {
-        std::cerr << archive_error_string(a) << "\n";
-        archive_read_free(a);
-        return false;
-    }
-
     struct archive* ext = archive_write_disk_new();
     archive_write_disk_set_options(
         ext,
@@ -54,8 +38,10 @@ bool ZipUtil::extract(const std::string& archivePath,
     archive_write_disk_set_standard_lookup(ext);
 
     archive_entry* entry;
+    bool failed = false;
+    int hr;
 
-    while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
+    while ((hr = archive_read_next_header(a, &entry)) == ARCHIVE_OK || hr == ARCHIVE_WARN) {
         std::string entryName = archive_entry_pathname(entry);
 
         if (!entryName.empty() && entryName[0] == '/')
@@ -79,6 +65,9 @@ bool ZipUtil::extract(const std::string& archivePath,
             cb(progress, "extracting " + name);
         }
 
+        if (files && archive_entry_filetype(entry) == AE_IFREG)
+            files->push_back(safePath.generic_string());
+
         int r = archive_write_header(ext, entry);
         if (r < ARCHIVE_OK)
             std::cerr << "Header failed: " << archive_error_string(ext) << "\n";
@@ -91,6 +80,7 @@ bool ZipUtil::extract(const std::string& archivePath,
                 if (rd == ARCHIVE_EOF) break;
                 if (rd < ARCHIVE_OK) {
                     std::cerr << "Read failed: " << archive_error_string(a) << "\n";
+                    failed = rd < ARCHIVE_WARN;
                     break;
                 }
                 int wr = archive_write_data_block(ext, buff, size, offset);
@@ -104,7 +94,12 @@ bool ZipUtil::extract(const std::string& archivePath,
         archive_write_finish_entry(ext);
     }
 
-    if (cb)
+    if (hr != ARCHIVE_EOF) {
+        std::cerr << "Archive read failed: " << archive_error_string(a) << "\n";
+        failed = true;
+    }
+
+    if (cb && !failed)
         cb(1.0f, "Extraction complete");
 
     archive_write_close(ext);
@@ -112,7 +107,59 @@ bool ZipUtil::extract(const std::string& archivePath,
     archive_read_close(a);
     archive_read_free(a);
 
-    return true;
+    return !failed;
+}
+
+bool ZipUtil::extract(const std::string& archivePath,
+                      const std::string& destPath,
+                      ProgressCallback cb,
+                      std::vector<std::string>* files)
+{
+    if (!fs::exists(archivePath) || fs::file_size(archivePath) == 0)
+        return false;
+
+    size_t totalBytes = fs::file_size(archivePath);
+
+    struct archive* a = archive_read_new();
+    archive_read_support_format_all(a);
+    archive_read_support_filter_all(a);
+
+    if (archive_read_open_filename(a, archivePath.c_str(), 10240) != ARCHIVE_OK) {
+        std::cerr << archive_error_string(a) << "\n";
+        archive_read_free(a);
+        return false;
+    }
+
+    return extractArchive(a, totalBytes, destPath, cb, files);
+}
+
+static la_ssize_t readBlock(struct archive* a, void* client, const void** buff) {
+    auto* reader = static_cast<ZipUtil::BlockReader*>(client);
+    long n = (*reader)(buff);
+    if (n < 0) {
+        archive_set_error(a, EIO, "stream read failed");
+        return ARCHIVE_FATAL;
+    }
+    return n;
+}
+
+bool ZipUtil::extract(BlockReader reader, uint64_t totalBytes,
+                      const std::string& destPath, ProgressCallback cb,
+                      std::vector<std::string>* files)
+{
+    struct archive* a = archive_read_new();
+    // No seek callback, so zip entries are read in streaming mode from
+    // their local headers rather than from the central directory.
+    archive_read_support_format_all(a);
+    archive_read_support_filter_all(a);
+
+    if (archive_read_open(a, &reader, nullptr, readBlock, nullptr) != ARCHIVE_OK) {
+        std::cerr << archive_error_string(a) << "\n";
+        archive_read_free(a);
+        return false;
+    }
+
+    return extractArchive(a, totalBytes ? totalBytes : 1, destPath, cb, files);
 }
 
 }
@@ -0,0 +1,89 @@
+#include "cache_manager.h"
+#include "path_manager.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+class CacheManagerTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    // PathManager resolves ~/.rsjfw once, on first use.
+    home = fs::current_path() / "test_cache_home";
+    setenv("HOME", home.c_str(), 1);
+    fs::remove_all(home);
+    rsjfw::PathManager::instance().init();
+    fs::create_directories(root() / "downloads");
+    now = std::time(nullptr);
+  }
+
+  void TearDown() override { fs::remove_all(home); }
+
+  fs::path root() const { return rsjfw::PathManager::instance().root(); }
+
+  // Writes bytes bytes to path, last touched ago seconds before now.
+  void file(const fs::path &path, size_t bytes, time_t ago) {
+    fs::create_directories(path.parent_path());
+    std::ofstream(path, std::ios::binary) << std::string(bytes, 'x');
+    struct timespec ts[2] = {{now - ago, 0}, {now - ago, 0}};
+    utimensat(AT_FDCWD, path.c_str(), ts, 0);
+  }
+
+  void version(const std::string &guid, time_t installedAgo,
+               time_t launchedAgo = -1) {
+    fs::path dir = rsjfw::PathManager::instance().versions() / guid;
+    file(dir / "RobloxStudioBeta.exe", 1 << 20, installedAgo);
+    file(dir / "AppSettings.xml", 16, installedAgo);
+    if (launchedAgo >= 0)
+      file(dir / ".rsjfw-last-used", 10, launchedAgo);
+  }
+
+  bool evicted(const rsjfw::CacheManager::Report &report,
+               const fs::path &path) {
+    return std::find(report.evicted.begin(), report.evicted.end(),
+                     path.string()) != report.evicted.end();
+  }
+
+  fs::path home;
+  time_t now = 0;
+};
+
+TEST_F(CacheManagerTest, PrefetchedVersionDoesNotEvictRunningOne) {
+  const time_t day = 24 * 3600;
+  version("version-running", 3 * day, 3600);
+  version("version-older", 5 * day, 4 * day);
+  // A background install just finished while version-running is open.
+  version("version-prefetched", 0);
+  file(root() / "cache" / "old.zip", 1 << 20, 6 * day);
+
+  auto report = rsjfw::CacheManager::instance().collect(0, true);
+  auto versions = rsjfw::PathManager::instance().versions();
+  EXPECT_FALSE(evicted(report, versions / "version-running"));
+  EXPECT_FALSE(evicted(report, versions / "version-prefetched"));
+  EXPECT_TRUE(evicted(report, versions / "version-older"));
+  EXPECT_TRUE(evicted(report, root() / "cache" / "old.zip"));
+  EXPECT_TRUE(fs::exists(versions / "version-older"));
+}
+
+TEST_F(CacheManagerTest, EvictsLeastRecentlyUsedUntilUnderBudget) {
+  const time_t day = 24 * 3600;
+  file(root() / "cache" / "a.zip", 1 << 20, 3 * day);
+  file(root() / "cache" / "b.zip", 1 << 20, 2 * day);
+  file(root() / "cache" / "c.zip", 1 << 20, day);
+  // Still being downloaded.
+  file(root() / "downloads" / "dxvk.tar.gz.part", 1 << 20, 60);
+
+  uintmax_t total = rsjfw::CacheManager::instance().usage().total();
+  auto report =
+      rsjfw::CacheManager::instance().collect(total - (1 << 20) - 1);
+  EXPECT_EQ(report.evicted.size(), 2u);
+  EXPECT_FALSE(fs::exists(root() / "cache" / "a.zip"));
+  EXPECT_FALSE(fs::exists(root() / "cache" / "b.zip"));
+  EXPECT_TRUE(fs::exists(root() / "cache" / "c.zip"));
+  EXPECT_TRUE(fs::exists(root() / "downloads" / "dxvk.tar.gz.part"));
+  EXPECT_LE(report.after.total(), total - (2 << 20));
+}
@@ -0,0 +1,124 @@
+#include "content_store.h"
+#include "path_manager.h"
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <sstream>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+class ContentStoreTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    // PathManager resolves ~/.rsjfw once, on first use.
+    home = fs::current_path() / "test_store_home";
+    setenv("HOME", home.c_str(), 1);
+    fs::remove_all(home);
+    rsjfw::PathManager::instance().init();
+  }
+
+  void TearDown() override { fs::remove_all(home); }
+
+  void write(const fs::path &path, const std::string &data) {
+    fs::create_directories(path.parent_path());
+    std::ofstream(path, std::ios::binary) << data;
+  }
+
+  std::string read(const fs::path &path) {
+    std::ifstream ifs(path, std::ios::binary);
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    return ss.str();
+  }
+
+  uint64_t hashOf(const std::string &data) {
+    fs::path path = home / "hash.bin";
+    write(path, data);
+    bool ok = false;
+    uint64_t hash = rsjfw::ContentStore::hashFile(path, ok);
+    EXPECT_TRUE(ok);
+    return hash;
+  }
+
+  size_t objectCount() {
+    size_t n = 0;
+    for (const auto &e : fs::recursive_directory_iterator(
+             rsjfw::PathManager::instance().store()))
+      n += e.is_regular_file() && e.path().filename() != ".lock";
+    return n;
+  }
+
+  fs::path home;
+};
+
+TEST_F(ContentStoreTest, HashMatchesXXH64Reference) {
+  EXPECT_EQ(hashOf(""), 0xef46db3751d8e999ULL);
+  EXPECT_EQ(hashOf("a"), 0xd24ec4f1a98c6e5bULL);
+  EXPECT_EQ(hashOf("abc"), 0x44bc2cf5ad770999ULL);
+  // Long enough for the four-lane stripe loop.
+  EXPECT_EQ(hashOf("Nobody inspects the spammish repetition"),
+            0xfbcea83c8a378bf1ULL);
+
+  // Spans several read() calls, ending mid-stripe.
+  std::string big((3 << 20) + 5, '\0');
+  for (size_t i = 0; i < big.size(); ++i)
+    big[i] = static_cast<char>(i * 131 + 7);
+  EXPECT_EQ(hashOf(big), 0x1ccacef43c9b6c88ULL);
+}
+
+TEST_F(ContentStoreTest, IngestDedupsAcrossVersionsAndPruneKeepsLive) {
+  auto &store = rsjfw::ContentStore::instance();
+  fs::path versions = rsjfw::PathManager::instance().versions();
+  std::string shared(64 << 10, 's'), old(1000, 'o'), fresh(2000, 'f');
+  write(versions / "v1" / "shared.dll", shared);
+  write(versions / "v1" / "content" / "old.txt", old);
+  write(versions / "v2" / "shared.dll", shared);
+  write(versions / "v2" / "content" / "new.txt", fresh);
+
+  auto first = store.ingest(versions / "v1");
+  EXPECT_EQ(first.files, 2u);
+  EXPECT_EQ(first.deduped, 0u);
+
+  auto second = store.ingest(versions / "v2");
+  EXPECT_EQ(second.files, 2u);
+  EXPECT_EQ(second.deduped, 1u);
+  EXPECT_EQ(second.bytesSaved, shared.size());
+  EXPECT_EQ(objectCount(), 3u);
+
+  auto refs1 = store.references(versions / "v1");
+  auto refs2 = store.references(versions / "v2");
+  ASSERT_EQ(refs2.size(), 2u);
+  EXPECT_EQ(refs1["shared.dll"], refs2["shared.dll"]);
+  EXPECT_TRUE(refs2.count("content/new.txt"));
+
+  // Linked files still read back as their own contents.
+  EXPECT_EQ(read(versions / "v2" / "shared.dll"), shared);
+  // A shared inode must not be writable through any one version.
+  struct stat sb;
+  ASSERT_EQ(stat((versions / "v2" / "shared.dll").c_str(), &sb), 0);
+  if (sb.st_nlink > 1)
+    EXPECT_EQ(sb.st_mode & 0222, 0u);
+  EXPECT_EQ(read(versions / "v1" / "content" / "old.txt"), old);
+
+  // Nothing is unreferenced yet.
+  EXPECT_EQ(store.prune(), 0u);
+
+  fs::remove_all(versions / "v1");
+  EXPECT_EQ(store.prune(), 1u);
+  EXPECT_EQ(objectCount(), 2u);
+  EXPECT_EQ(read(versions / "v2" / "shared.dll"), shared);
+
+  fs::remove_all(versions / "v2");
+  EXPECT_EQ(store.prune(), 2u);
+  EXPECT_EQ(objectCount(), 0u);
+}
+
+TEST_F(ContentStoreTest, PruneSkipsLinksBeingPlaced) {
+  fs::path store = rsjfw::PathManager::instance().store();
+  write(store / "ab" / "abcdef0123456789-10.rsjfw-tmp", "in flight");
+  write(store / "ab" / "abcdef0123456789-10", "orphan");
+  EXPECT_EQ(rsjfw::ContentStore::instance().prune(), 1u);
+  EXPECT_TRUE(fs::exists(store / "ab" / "abcdef0123456789-10.rsjfw-tmp"));
+  EXPECT_TRUE(fs::exists(store / ".lock"));
+}
@@ -0,0 +1,56 @@
+#include "md5.h"
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <string>
+#include <utility>
+
+namespace {
+
+std::string md5Of(const std::string &data) {
+  rsjfw::MD5 md5;
+  md5.update(data.data(), data.size());
+  return md5.hexDigest();
+}
+
+// RFC 1321, appendix A.5.
+const std::pair<const char *, const char *> kSuite[] = {
+    {"", "d41d8cd98f00b204e9800998ecf8427e"},
+    {"a", "0cc175b9c0f1b6a831c399e269772661"},
+    {"abc", "900150983cd24fb0d6963f7d28e17f72"},
+    {"message digest", "f96b697d7cb7938d525a2f31aaf161d0"},
+    {"abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b"},
+    {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+     "d174ab98d277d9f5a5611c2c9f419d9f"},
+    {"1234567890123456789012345678901234567890"
+     "1234567890123456789012345678901234567890",
+     "57edf4a22be3c955ac49da2e2107b67a"},
+};
+
+} // namespace
+
+TEST(MD5Test, RFC1321TestSuite) {
+  for (const auto &[input, digest] : kSuite)
+    EXPECT_EQ(md5Of(input), digest) << '"' << input << '"';
+}
+
+TEST(MD5Test, ChunkedUpdatesMatchOneShot) {
+  // Streamed and resumed downloads feed the hash in arbitrary pieces.
+  std::string data;
+  for (int i = 0; i < 1000; ++i)
+    data += static_cast<char>(i * 31);
+  std::string expected = md5Of(data);
+  for (size_t step : {1, 3, 63, 64, 65, 500}) {
+    rsjfw::MD5 md5;
+    for (size_t off = 0; off < data.size(); off += step)
+      md5.update(data.data() + off, std::min(step, data.size() - off));
+    EXPECT_EQ(md5.hexDigest(), expected) << "step " << step;
+  }
+}
+
+TEST(MD5Test, ResetStartsOver) {
+  rsjfw::MD5 md5;
+  md5.update("garbage", 7);
+  md5.reset();
+  md5.update("abc", 3);
+  EXPECT_EQ(md5.hexDigest(), "900150983cd24fb0d6963f7d28e17f72");
+}
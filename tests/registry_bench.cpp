@@ -0,0 +1,361 @@
+#include "registry.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Self-timed microbenchmarks for the registry tree, its hex codecs and the
+// Registry hive operations on a generated prefix. ctest runs a small
+// instance as a smoke test; for numbers run it by hand:
+//
+//   registry_bench [children] [--keys N] [--depth D] [--values V]
+//                  [--blob BYTES] [--json FILE]
+//
+// children sizes the in-memory tree benchmarks. The synthetic hives hold
+// --keys keys spread over --depth levels below Software\Gen, each with
+// --values values cycling through string, dword and binary (--blob bytes).
+// --json writes every result to FILE for tracking across builds.
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+static double nsPerOp(Clock::time_point start, size_t ops) {
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                Clock::now() - start)
+                .count();
+  return static_cast<double>(ns) / static_cast<double>(ops);
+}
+
+static double msSince(Clock::time_point start) {
+  return nsPerOp(start, 1) / 1e6;
+}
+
+struct Result {
+  std::string name;
+  double value;
+  const char *unit;
+};
+
+static std::vector<Result> results;
+
+static void report(const std::string &name, double value, const char *unit) {
+  printf("%-16s %10.1f %s\n", (name + ":").c_str(), value, unit);
+  results.push_back({name, value, unit});
+}
+
+struct HiveShape {
+  size_t keys = 0;
+  size_t depth = 4;
+  size_t values = 4;
+  size_t blob = 64;
+};
+
+// Path of the i-th generated key. Components are zero padded so the keys
+// come out in the case-insensitive order Wine writes them in.
+static std::string genPath(const HiveShape &shape, size_t fanout, size_t i,
+                           const char *sep) {
+  std::vector<size_t> digits(shape.depth);
+  for (size_t d = shape.depth; d-- > 0;) {
+    digits[d] = i % fanout;
+    i /= fanout;
+  }
+  std::string p = std::string("Software") + sep + "Gen";
+  char buf[16];
+  for (size_t d : digits) {
+    snprintf(buf, sizeof(buf), "K%05zu", d);
+    p += sep;
+    p += buf;
+  }
+  return p;
+}
+
+static size_t fanoutFor(const HiveShape &shape) {
+  double keys = static_cast<double>(shape.keys);
+  auto f = static_cast<size_t>(
+      std::ceil(std::pow(keys, 1.0 / static_cast<double>(shape.depth))));
+  return std::max<size_t>(f, 2);
+}
+
+static std::string generateHive(const HiveShape &shape, const char *root) {
+  std::string out = "WINE REGISTRY Version 2\n;; All keys relative to ";
+  out += root;
+  out += "\n\n#arch=win64\n\n";
+  size_t fanout = fanoutFor(shape);
+  char buf[128];
+  for (size_t i = 0; i < shape.keys; ++i) {
+    out += '[';
+    out += genPath(shape, fanout, i, "\\\\");
+    out += "] 1700000000\n#time=1d9a0b0c0d0e0f0\n";
+    for (size_t v = 0; v < shape.values; ++v) {
+      switch (v % 3) {
+      case 0:
+        snprintf(buf, sizeof(buf), "\"S%zu\"=\"value %zu of key %zu\"\n", v,
+                 v, i);
+        out += buf;
+        break;
+      case 1:
+        snprintf(buf, sizeof(buf), "\"D%zu\"=dword:%08zx\n", v, i * 31 + v);
+        out += buf;
+        break;
+      default: {
+        snprintf(buf, sizeof(buf), "\"B%zu\"=hex:", v);
+        out += buf;
+        size_t col = strlen(buf);
+        for (size_t b = 0; b < shape.blob; ++b) {
+          snprintf(buf, sizeof(buf), "%02zx", (i + b * 7) & 0xff);
+          out += buf;
+          col += 2;
+          if (b + 1 < shape.blob) {
+            out += ',';
+            if (++col > 75) {
+              out += "\\\n  ";
+              col = 2;
+            }
+          }
+        }
+        out += '\n';
+      }
+      }
+    }
+    out += '\n';
+  }
+  return out;
+}
+
+static void writeFile(const fs::path &p, const std::string &data) {
+  // Replaced by rename, the way Wine saves, so watchers see one event.
+  fs::path tmp = p;
+  tmp += ".tmp";
+  std::ofstream(tmp, std::ios::binary) << data;
+  fs::rename(tmp, p);
+}
+
+static bool writeJson(const std::string &path, const HiveShape &shape,
+                      size_t children) {
+  std::ofstream os(path);
+  if (!os)
+    return false;
+  os << "{\n  \"config\": {\"children\": " << children
+     << ", \"keys\": " << shape.keys << ", \"depth\": " << shape.depth
+     << ", \"values\": " << shape.values << ", \"blob\": " << shape.blob
+     << "},\n  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto &r = results[i];
+    os << "    {\"name\": \"" << r.name << "\", \"value\": " << r.value
+       << ", \"unit\": \"" << r.unit << "\"}"
+       << (i + 1 < results.size() ? ",\n" : "\n");
+  }
+  os << "  ]\n}\n";
+  return static_cast<bool>(os);
+}
+
+// Load, save, query, add, transplant and reload of whole hives through
+// Registry. src and dst hold the same generated hives.
+static bool runHives(const HiveShape &shape, const fs::path &src,
+                     const fs::path &dst, const std::string &system) {
+  size_t fanout = fanoutFor(shape);
+  std::vector<std::string> paths;
+  size_t stride = std::max<size_t>(shape.keys / 1000, 1);
+  for (size_t i = 0; i < shape.keys; i += stride)
+    paths.push_back("HKLM\\" + genPath(shape, fanout, i, "\\"));
+  bool ok = true;
+
+  auto t = Clock::now();
+  { rsjfw::Registry cold(src.string()); }
+  report("load cold", msSince(t), "ms");
+  t = Clock::now();
+  { rsjfw::Registry lazy(src.string(), rsjfw::Registry::LoadMode::Lazy); }
+  report("load lazy", msSince(t), "ms");
+
+  t = Clock::now();
+  rsjfw::Registry reg(src.string());
+  report("load cached", msSince(t), "ms");
+
+  const size_t lookups = 200000;
+  size_t found = 0;
+  t = Clock::now();
+  for (size_t i = 0; i < lookups; ++i)
+    if (reg.query(paths[(i * 7919) % paths.size()], "S0"))
+      ++found;
+  report("hive query", nsPerOp(t, lookups), "ns/op");
+  ok &= shape.values == 0 || found == lookups;
+
+  const size_t adds = 10000;
+  t = Clock::now();
+  for (size_t i = 0; i < adds; ++i)
+    reg.add("HKCU\\Software\\Bench\\K" + std::to_string(i % 100), "V",
+            std::to_string(i));
+  report("hive add", nsPerOp(t, adds), "ns/op");
+
+  t = Clock::now();
+  ok &= reg.commit();
+  report("save", msSince(t), "ms");
+
+  // Identical subtrees: only hashing, nothing to merge.
+  rsjfw::Registry target(dst.string());
+  t = Clock::now();
+  size_t same = target.transplant("HKLM\\Software\\Gen", reg);
+  report("transplant same", msSince(t), "ms");
+  ok &= same == 0;
+
+  reg.add(paths[paths.size() / 2], "S0", "changed");
+  t = Clock::now();
+  size_t changed = target.transplant("HKLM\\Software\\Gen", reg);
+  report("transplant diff", msSince(t), "ms");
+  ok &= changed == 1;
+
+  if (shape.values == 0)
+    return ok;
+
+  // Rewritten behind the registry's back; time until a query sees it.
+  std::string edited = system;
+  edited.replace(edited.find("value 0 of key 0"), 16, "value X of key 0");
+  std::string first = "HKLM\\" + genPath(shape, fanout, 0, "\\");
+  t = Clock::now();
+  writeFile(src / "system.reg", edited);
+  bool reloaded = false;
+  while (msSince(t) < 10000) {
+    auto v = reg.query(first, "S0");
+    if (v && *v == "value X of key 0") {
+      reloaded = true;
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  report("reload", msSince(t), "ms");
+  return ok && reloaded;
+}
+
+static bool benchHives(const HiveShape &shape) {
+  fs::path dir = fs::temp_directory_path() /
+                 ("rsjfw_bench_" + std::to_string(getpid()));
+  fs::path src = dir / "src", dst = dir / "dst";
+  fs::create_directories(src);
+  fs::create_directories(dst);
+  std::string system = generateHive(shape, "REGISTRY\\\\Machine");
+  std::string user =
+      generateHive(shape, "REGISTRY\\\\User\\\\S-1-5-21-0-0-0-1000");
+  for (const auto &d : {src, dst}) {
+    writeFile(d / "system.reg", system);
+    writeFile(d / "user.reg", user);
+  }
+  report("hive size", static_cast<double>(system.size()) / (1 << 20), "MiB");
+  bool ok = runHives(shape, src, dst, system);
+  fs::remove_all(dir);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  size_t children = 20000;
+  HiveShape shape;
+  std::string json;
+  for (int i = 1; i < argc; ++i) {
+    auto num = [&](size_t &out) {
+      if (i + 1 < argc)
+        out = std::strtoul(argv[++i], nullptr, 10);
+    };
+    if (!strcmp(argv[i], "--keys"))
+      num(shape.keys);
+    else if (!strcmp(argv[i], "--depth"))
+      num(shape.depth);
+    else if (!strcmp(argv[i], "--values"))
+      num(shape.values);
+    else if (!strcmp(argv[i], "--blob"))
+      num(shape.blob);
+    else if (!strcmp(argv[i], "--json") && i + 1 < argc)
+      json = argv[++i];
+    else
+      children = std::strtoul(argv[i], nullptr, 10);
+  }
+  // Without --keys the hives follow children, so the smoke test stays small.
+  if (shape.keys == 0)
+    shape.keys = children;
+  shape.depth = std::max<size_t>(shape.depth, 1);
+  const size_t lookups = 1000000;
+
+  rsjfw::RegistryKey root;
+  std::vector<std::string> paths;
+  paths.reserve(children);
+  for (size_t i = 0; i < children; ++i) {
+    char buf[128];
+    snprintf(buf, sizeof(buf),
+             "Software\\Classes\\CLSID\\{%08zX-0000-0000-0000-%012zX}"
+             "\\InprocServer32",
+             i, i * 7);
+    paths.emplace_back(buf);
+  }
+
+  auto t = Clock::now();
+  for (const auto &p : paths)
+    root.add(p)->setValue("ThreadingModel", rsjfw::RegistryType::String,
+                          std::vector<uint8_t>{'B', 'o', 't', 'h'});
+  report("add", nsPerOp(t, children), "ns/op");
+
+  size_t found = 0;
+  t = Clock::now();
+  for (size_t i = 0; i < lookups; ++i) {
+    // Query with different casing than was inserted.
+    std::string p = paths[(i * 7919) % children];
+    p[0] = 's';
+    if (root.query(p))
+      ++found;
+  }
+  report("deep query", nsPerOp(t, lookups), "ns/op");
+
+  auto *clsid = root.query("Software\\Classes\\CLSID");
+  t = Clock::now();
+  for (size_t i = 0; i < lookups; ++i) {
+    auto *k = clsid->subkeys[(i * 7919) % children]->query("inprocserver32");
+    if (k && k->getValue("threadingmodel"))
+      ++found;
+  }
+  report("getValue", nsPerOp(t, lookups), "ns/op");
+
+  // Binary-heavy key, shaped like Credential Manager blobs: the hex codecs
+  // dominate both directions.
+  const size_t blobs = 256;
+  const size_t blobSize = 4096;
+  rsjfw::RegistryKey bin;
+  auto *creds = bin.add("Software\\Wine\\Credential Manager");
+  std::vector<uint8_t> blob(blobSize);
+  for (size_t i = 0; i < blobs; ++i) {
+    for (size_t j = 0; j < blobSize; ++j)
+      blob[j] = static_cast<uint8_t>((i * 131 + j * 31) ^ (j >> 3));
+    creds->setValue("Blob" + std::to_string(i), rsjfw::RegistryType::Binary,
+                    blob);
+  }
+  const double mib = static_cast<double>(blobs * blobSize) / (1 << 20);
+
+  std::ostringstream text;
+  text << "WINE REGISTRY Version 2\n";
+  t = Clock::now();
+  bin.save(text, "");
+  report("hex encode", nsPerOp(t, 1) / 1e6 / mib, "ms/MiB");
+
+  std::string hive = text.str();
+  rsjfw::RegistryKey reloaded;
+  t = Clock::now();
+  reloaded.load(std::string_view(hive));
+  report("hex decode", nsPerOp(t, 1) / 1e6 / mib, "ms/MiB");
+
+  auto *back = reloaded.query("Software\\Wine\\Credential Manager");
+  bool same = back && back->values.size() == blobs &&
+              std::equal(back->values.back().data.begin(),
+                         back->values.back().data.end(), blob.begin(),
+                         blob.end());
+
+  bool hivesOk = benchHives(shape);
+  if (!json.empty() && !writeJson(json, shape, children)) {
+    fprintf(stderr, "failed to write %s\n", json.c_str());
+    return 1;
+  }
+  return found == 2 * lookups && same && hivesOk ? 0 : 1;
+}
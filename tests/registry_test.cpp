@@ -74,3 +74,56 @@ TEST_F(RegistryTest, HexTypes) {
     ASSERT_TRUE(val.has_value());
     EXPECT_EQ(val.value(), "010203");
 }
+
+TEST_F(RegistryTest, WideKeyIndexStaysInSync) {
+    rsjfw::RegistryKey root;
+    for (int i = 0; i < 100; ++i)
+        root.add("Classes\\Key" + std::to_string(i))
+            ->setValue("Val" + std::to_string(i), rsjfw::RegistryType::String, std::vector<uint8_t>{'x'});
+
+    auto* classes = root.query("classes");
+    ASSERT_NE(classes, nullptr);
+    EXPECT_NE(root.query("CLASSES\\key42"), nullptr);
+
+    EXPECT_TRUE(root.deleteKey("Classes\\KEY42"));
+    EXPECT_EQ(root.query("Classes\\Key42"), nullptr);
+    EXPECT_EQ(classes->subkeys.size(), 99u);
+
+    root.add("Classes\\key42");
+    EXPECT_NE(root.query("Classes\\Key42"), nullptr);
+    EXPECT_EQ(classes->subkeys.size(), 100u);
+
+    auto* k = root.query("Classes\\Key7");
+    for (int i = 0; i < 20; ++i)
+        k->setValue("V" + std::to_string(i), rsjfw::RegistryType::Dword, std::vector<uint8_t>{1, 0, 0, 0});
+    EXPECT_TRUE(k->deleteValue("v3"));
+    EXPECT_EQ(k->getValue("V3"), nullptr);
+    ASSERT_NE(k->getValue("v19"), nullptr);
+    EXPECT_EQ(k->getValue("v19")->name, "V19");
+
+    rsjfw::RegistryKey copy;
+    copy.add("Classes")->copyFrom(*classes);
+    EXPECT_NE(copy.query("classes\\KEY7"), nullptr);
+    ASSERT_NE(copy.query("Classes\\Key7")->getValue("V10"), nullptr);
+}
+
+TEST_F(RegistryTest, SaveSortsChildrenOnceAndFormatsValues) {
+    rsjfw::RegistryKey root;
+    root.add("Software\\zeta")->setValue("", rsjfw::RegistryType::String, std::vector<uint8_t>{'z'});
+    root.add("Software\\Alpha")->setValue("n\"q", rsjfw::RegistryType::Dword, std::vector<uint8_t>{0xcd, 0xab, 0, 0});
+    root.add("Software\\beta")->setValue("c", rsjfw::RegistryType::Custom, std::vector<uint8_t>{1, 2}, 0x80000001);
+
+    std::string out;
+    root.save(out, "");
+    EXPECT_EQ(out,
+              "[Software\\\\Alpha] 1700000000\n\"n\\\"q\"=dword:0000abcd\n\n"
+              "[Software\\\\beta] 1700000000\n\"c\"=hex(80000001):01,02\n\n"
+              "[Software\\\\zeta] 1700000000\n@=\"z\"\n\n");
+
+    auto* software = root.query("Software");
+    ASSERT_NE(software, nullptr);
+    EXPECT_EQ(software->subkeys.front()->name, "Alpha");
+    std::string again;
+    root.save(again, "");
+    EXPECT_EQ(again, out);
+}
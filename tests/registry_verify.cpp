@@ -3,6 +3,7 @@
 #include <fstream>
 #include <gtest/gtest.h>
 #include <iostream>
+#include <thread>
 
 namespace fs = std::filesystem;
 
@@ -72,3 +73,413 @@ TEST_F(RegistryVerifyTest, CaseInsensitivity) {
   ASSERT_TRUE(val.has_value());
   EXPECT_EQ(val.value(), "1");
 }
+
+TEST_F(RegistryVerifyTest, CommitSkipsUnchangedHives) {
+  // No "#arch" line: a rewrite of this hive would be visible.
+  std::string content = "WINE REGISTRY Version 2\n"
+                        ";; All keys relative to REGISTRY\\\\Machine\n\n"
+                        "[Software\\\\Test] 1700000000\n"
+                        "\"Value\"=\"1\"\n";
+
+  fs::path regPath = testDir / "system.reg";
+  std::ofstream os(regPath);
+  os << content;
+  os.close();
+
+  {
+    rsjfw::Registry reg(testDir.string());
+    reg.add("HKLM\\Software\\Test", "Value", "1");
+    EXPECT_EQ(reg.dirtyKeyCount(), 0u);
+
+    reg.add("HKCU\\Software\\Roblox\\RobloxStudio\\Themes", "CurrentTheme",
+            "Dark");
+    EXPECT_EQ(reg.dirtyKeyCount(), 4u);
+    ASSERT_TRUE(reg.commit());
+    EXPECT_EQ(reg.dirtyKeyCount(), 0u);
+  }
+
+  std::ifstream is(regPath);
+  std::string after((std::istreambuf_iterator<char>(is)),
+                    std::istreambuf_iterator<char>());
+  EXPECT_EQ(after, content);
+  EXPECT_TRUE(fs::exists(testDir / "user.reg"));
+}
+
+TEST_F(RegistryVerifyTest, TransplantOnlyTouchesDifferences) {
+  fs::path srcDir = testDir / "src";
+  fs::path dstDir = testDir / "dst";
+  fs::create_directories(srcDir);
+  fs::create_directories(dstDir);
+  std::string content = "WINE REGISTRY Version 2\n"
+                        ";; All keys relative to "
+                        "REGISTRY\\\\User\\\\S-1-5-21-0-0-0-1000\n\n"
+                        "[Software\\\\Roblox\\\\RobloxStudio] 1700000000\n"
+                        "\"A\"=\"1\"\n"
+                        "\"B\"=dword:00000002\n\n"
+                        "[Software\\\\Roblox\\\\RobloxStudio\\\\Sub] 1700000000\n"
+                        "\"C\"=hex:01,02\n";
+  for (const auto &d : {srcDir, dstDir}) {
+    std::ofstream os(d / "user.reg");
+    os << content;
+  }
+
+  const std::string path = "HKCU\\Software\\Roblox\\RobloxStudio";
+  rsjfw::Registry src(srcDir.string());
+  rsjfw::Registry dst(dstDir.string(), rsjfw::Registry::LoadMode::Lazy);
+  EXPECT_EQ(dst.transplant(path, src), 0u);
+  EXPECT_EQ(dst.dirtyKeyCount(), 0u);
+
+  src.add(path, "A", "2");
+  src.add(path + "\\Sub\\New", "D", "x");
+  // One updated value, one new key holding one value.
+  EXPECT_EQ(dst.transplant(path, src), 3u);
+  EXPECT_EQ(dst.query(path, "A"), "2");
+  EXPECT_EQ(dst.query(path + "\\Sub\\New", "D"), "x");
+  EXPECT_EQ(dst.query(path + "\\Sub", "C"), src.query(path + "\\Sub", "C"));
+  EXPECT_EQ(dst.transplant(path, src), 0u);
+}
+
+TEST_F(RegistryVerifyTest, RevertRestoresSnapshot) {
+  std::string content = "WINE REGISTRY Version 2\n"
+                        ";; All keys relative to REGISTRY\\\\Machine\n\n"
+                        "[Software\\\\Test] 1700000000\n"
+                        "\"Value\"=\"1\"\n\n"
+                        "[Software\\\\Other] 1700000000\n"
+                        "\"Keep\"=dword:00000001\n";
+
+  fs::path regPath = testDir / "system.reg";
+  {
+    std::ofstream os(regPath);
+    os << content;
+  }
+
+  for (auto mode :
+       {rsjfw::Registry::LoadMode::Lazy, rsjfw::Registry::LoadMode::Eager}) {
+    rsjfw::Registry reg(testDir.string(), mode);
+    auto snap = reg.snapshot();
+
+    reg.add("HKLM\\Software\\Test", "Value", "2");
+    reg.add("HKLM\\Software\\New", "Value", "3");
+    ASSERT_TRUE(reg.commit());
+    EXPECT_EQ(reg.query("HKLM\\Software\\Test", "Value"), "2");
+
+    reg.revert(snap);
+    EXPECT_EQ(reg.query("HKLM\\Software\\Test", "Value"), "1");
+    EXPECT_FALSE(reg.query("HKLM\\Software\\New", "Value").has_value());
+    ASSERT_TRUE(reg.commit());
+
+    std::ifstream is(regPath);
+    std::string after((std::istreambuf_iterator<char>(is)),
+                      std::istreambuf_iterator<char>());
+    if (mode == rsjfw::Registry::LoadMode::Lazy) {
+      EXPECT_EQ(after, content);
+    }
+    EXPECT_EQ(after.find("[Software\\\\New]"), std::string::npos);
+    EXPECT_NE(after.find("\"Value\"=\"1\""), std::string::npos);
+
+    // Writing after a revert leaves the snapshot intact.
+    reg.add("HKLM\\Software\\Test", "Value", "4");
+    reg.revert(snap);
+    EXPECT_EQ(reg.query("HKLM\\Software\\Test", "Value"), "1");
+  }
+}
+
+TEST_F(RegistryVerifyTest, RepeatedEditsDoNotGrowArenaWithoutBound) {
+  {
+    std::ofstream os(testDir / "system.reg");
+    os << "WINE REGISTRY Version 2\n"
+          ";; All keys relative to REGISTRY\\\\Machine\n\n"
+          "[Software\\\\Keep] 1700000000\n"
+          "\"V\"=\"1\"\n";
+  }
+  rsjfw::Registry reg(testDir.string());
+  // Each round replaces a 100 KB value with a longer one, so its old
+  // buffer is dead weight.
+  std::string big;
+  for (int i = 0; i < 200; ++i) {
+    big.assign((100 << 10) + i * 64, static_cast<char>('a' + i % 26));
+    reg.add("HKLM\\Software\\Churn", "Blob", big);
+    ASSERT_TRUE(reg.commit());
+  }
+  EXPECT_EQ(reg.query("HKLM\\Software\\Churn", "Blob"), big);
+  EXPECT_EQ(reg.query("HKLM\\Software\\Keep", "V"), "1");
+  EXPECT_LT(reg.snapshot().machine->footprint(), size_t(8) << 20);
+}
+
+TEST_F(RegistryVerifyTest, PinnedSnapshotNeverChanges) {
+  std::string content = "WINE REGISTRY Version 2\n"
+                        ";; All keys relative to REGISTRY\\\\Machine\n\n"
+                        "[Software\\\\B] 1700000000\n"
+                        "\"V\"=\"1\"\n\n"
+                        "[Software\\\\A] 1700000000\n"
+                        "\"V\"=\"2\"\n";
+  {
+    std::ofstream os(testDir / "system.reg");
+    os << content;
+  }
+
+  // Lazy parsing on a read must not land in the snapshot.
+  rsjfw::Registry lazy(testDir.string(), rsjfw::Registry::LoadMode::Lazy);
+  auto snap = lazy.snapshot();
+  ASSERT_TRUE(snap.machine);
+  EXPECT_TRUE(snap.machine->root()->subkeys.empty());
+  EXPECT_EQ(lazy.query("HKLM\\Software\\B", "V"), "1");
+  EXPECT_TRUE(snap.machine->root()->subkeys.empty());
+
+  // Nor may a commit sort it or clear its dirty keys.
+  rsjfw::Registry reg(testDir.string());
+  reg.add("HKLM\\Software\\Z", "V", "3");
+  reg.add("HKLM\\Software\\C", "V", "4");
+  auto dirty = reg.snapshot();
+  auto *software = dirty.machine->root()->query("Software");
+  ASSERT_NE(software, nullptr);
+  std::vector<std::string> order;
+  for (auto *k : software->subkeys)
+    order.emplace_back(k->name);
+  size_t dirtyKeys = dirty.machine->root()->dirtyCount();
+  ASSERT_TRUE(reg.commit());
+  std::vector<std::string> after;
+  for (auto *k : software->subkeys)
+    after.emplace_back(k->name);
+  EXPECT_EQ(after, order);
+  EXPECT_EQ(dirty.machine->root()->dirtyCount(), dirtyKeys);
+  EXPECT_EQ(reg.dirtyKeyCount(), 0u);
+
+  // Once the reverted-to snapshot is gone, the live hive is not pinned.
+  reg.revert(dirty);
+  dirty = {};
+  auto next = reg.snapshot();
+  auto live = rsjfw::RegistryArena::unpinned(next.machine);
+  next = {};
+  EXPECT_FALSE(live->pinned());
+  reg.add("HKLM\\Software\\A", "V", "5");
+  EXPECT_EQ(reg.query("HKLM\\Software\\A", "V"), "5");
+}
+
+TEST_F(RegistryVerifyTest, TransactionWritesTypedValuesInOneCommit) {
+  rsjfw::Registry reg(testDir.string());
+  {
+    rsjfw::Registry::Transaction tx(reg);
+    const uint8_t bin[] = {0x01, 0xab};
+    tx.setString("HKCU\\Software\\Wine\\DllOverrides", "d3d11", "native")
+        .setString("HKCU\\Software\\Wine\\DllOverrides", "dxgi", "native")
+        .setDword("HKLM\\Software\\Test", "Count", 42)
+        .setBinary("HKLM\\Software\\Test", "Blob", bin);
+    EXPECT_TRUE(tx.commit());
+  }
+  EXPECT_EQ(reg.dirtyKeyCount(), 0u);
+  EXPECT_EQ(reg.query("HKCU\\Software\\Wine\\DllOverrides", "dxgi"),
+            "native");
+
+  std::ifstream is(testDir / "system.reg");
+  std::string sys((std::istreambuf_iterator<char>(is)),
+                  std::istreambuf_iterator<char>());
+  EXPECT_NE(sys.find("\"Count\"=dword:0000002a"), std::string::npos);
+  EXPECT_NE(sys.find("\"Blob\"=hex:01,ab"), std::string::npos);
+}
+
+TEST_F(RegistryVerifyTest, RegistryCallsInsideTransactionShareItsLock) {
+  rsjfw::Registry reg(testDir.string());
+  {
+    rsjfw::Registry::Transaction tx(reg);
+    tx.setString("HKCU\\Software\\A", "x", "1");
+    // Each of these would deadlock if it took the lock again.
+    EXPECT_EQ(reg.query("HKCU\\Software\\A", "x"), "1");
+    reg.add("HKCU\\Software\\A", "y", "2");
+    auto snap = reg.snapshot();
+    // The cached key belongs to the now pinned hive; writing through it
+    // would change the snapshot.
+    tx.setString("HKCU\\Software\\A", "x", "3");
+    {
+      rsjfw::Registry::Transaction inner(reg);
+      inner.setString("HKCU\\Software\\A", "z", "4");
+      EXPECT_TRUE(inner.commit());
+    }
+    tx.setString("HKCU\\Software\\A", "w", "5");
+    EXPECT_TRUE(tx.commit());
+    EXPECT_EQ(reg.dirtyKeyCount(), 0u);
+
+    reg.revert(snap);
+    EXPECT_EQ(reg.query("HKCU\\Software\\A", "x"), "1");
+    EXPECT_FALSE(reg.query("HKCU\\Software\\A", "z").has_value());
+  }
+
+  // Other threads still wait for the transaction and then see its edits.
+  std::optional<std::string> seen;
+  std::thread other;
+  {
+    rsjfw::Registry::Transaction tx(reg);
+    other = std::thread([&] { seen = reg.query("HKCU\\Software\\A", "v"); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    tx.setString("HKCU\\Software\\A", "v", "6");
+    EXPECT_TRUE(tx.commit());
+  }
+  other.join();
+  EXPECT_EQ(seen, "6");
+}
+
+TEST_F(RegistryVerifyTest, TransactionAppliesSectionsAndExportsRegedit) {
+  std::string content = "WINE REGISTRY Version 2\n"
+                        ";; All keys relative to REGISTRY\\\\Machine\n\n"
+                        "[Software\\\\Keep] 1700000000\n"
+                        "\"A\"=\"1\"\n\n"
+                        "[Software\\\\Gone\\\\Child] 1700000000\n"
+                        "\"B\"=\"2\"\n";
+  {
+    std::ofstream os(testDir / "system.reg");
+    os << content;
+  }
+
+  rsjfw::Registry reg(testDir.string(), rsjfw::Registry::LoadMode::Lazy);
+  {
+    rsjfw::Registry::Transaction tx(reg);
+    EXPECT_TRUE(tx.apply("HKLM", "[Software\\\\Keep]\n"
+                                 "\"A\"=-\n"
+                                 "\"Exp\"=hex(2):25,00,41,00,25,00,00,00\n\n"
+                                 "[-Software\\\\Gone]\n"));
+    EXPECT_TRUE(tx.commit());
+  }
+  EXPECT_FALSE(reg.query("HKLM\\Software\\Keep", "A").has_value());
+  EXPECT_FALSE(reg.query("HKLM\\Software\\Gone\\Child", "B").has_value());
+
+  std::string text;
+  ASSERT_TRUE(reg.exportReg("HKLM\\Software\\Keep",
+                            [&](std::string_view s) { text += s; }));
+  EXPECT_EQ(text, "[HKEY_LOCAL_MACHINE\\Software\\Keep]\n"
+                  "\"Exp\"=hex(2):25,00,41,00,25,00,00,00\n\n");
+  EXPECT_FALSE(reg.exportReg("HKLM\\Software\\Gone", [](std::string_view) {}));
+}
+
+TEST_F(RegistryVerifyTest, WideStringValuesSurviveRegeditRoundTrip) {
+  rsjfw::Registry reg(testDir.string());
+  {
+    rsjfw::Registry::Transaction tx(reg);
+    EXPECT_TRUE(tx.apply("HKCU", "[Software\\\\Multi]\n"
+                                 "\"List\"=hex(7):61,00,00,00,62,00,00,00,00,00\n"
+                                 "\"Wide\"=hex(2):e9,00,00,00\n"));
+    EXPECT_TRUE(tx.commit());
+  }
+
+  std::string text;
+  ASSERT_TRUE(reg.exportReg("HKCU\\Software\\Multi",
+                            [&](std::string_view s) { text += s; }));
+  EXPECT_EQ(text, "[HKEY_CURRENT_USER\\Software\\Multi]\n"
+                  "\"List\"=hex(7):61,00,00,00,62,00,00,00,00,00\n"
+                  "\"Wide\"=hex(2):e9,00,00,00\n\n");
+}
+
+TEST_F(RegistryVerifyTest, HiveCacheIsUsedUntilHiveChanges) {
+  std::string content = "WINE REGISTRY Version 2\n"
+                        ";; All keys relative to REGISTRY\\\\Machine\n\n"
+                        "[Software\\\\Test] 1700000000\n"
+                        "#time=1d9a5c3e4f00000\n"
+                        "\"Str\"=\"Hello\"\n"
+                        "\"Dw\"=dword:0000002a\n"
+                        "\"Bin\"=hex:01,02,03\n";
+
+  fs::path regPath = testDir / "system.reg";
+  std::ofstream(regPath) << content;
+
+  { rsjfw::Registry reg(testDir.string()); }
+  ASSERT_TRUE(fs::exists(testDir / "system.reg.rsjfw-cache"));
+
+  {
+    rsjfw::Registry reg(testDir.string());
+    EXPECT_EQ(reg.query("HKLM\\Software\\Test", "Str").value_or(""), "Hello");
+    EXPECT_EQ(reg.query("HKLM\\Software\\Test", "Dw").value_or(""),
+              "dword:0000002a");
+    EXPECT_EQ(reg.query("HKLM\\Software\\Test", "Bin").value_or(""),
+              "hex:01,02,03");
+  }
+
+  std::ofstream(regPath, std::ios::app) << "\"Added\"=\"1\"\n";
+  {
+    rsjfw::Registry reg(testDir.string());
+    EXPECT_EQ(reg.query("HKLM\\Software\\Test", "Added").value_or(""), "1");
+
+    // A commit drops the cache instead of writing it again.
+    reg.add("HKLM\\Software\\Test", "Saved", "2");
+    ASSERT_TRUE(reg.commit());
+    EXPECT_FALSE(fs::exists(testDir / "system.reg.rsjfw-cache"));
+  }
+
+  // The next cold load rebuilds it.
+  rsjfw::Registry reg(testDir.string());
+  EXPECT_EQ(reg.query("HKLM\\Software\\Test", "Saved").value_or(""), "2");
+  EXPECT_TRUE(fs::exists(testDir / "system.reg.rsjfw-cache"));
+}
+
+TEST_F(RegistryVerifyTest, LazyLoadKeepsUntouchedSectionsVerbatim) {
+  std::string head = "WINE REGISTRY Version 2\n"
+                     ";; All keys relative to REGISTRY\\\\Machine\n\n"
+                     "#arch=win64\n\n";
+  std::string untouched = "[Software\\\\Odd] 1700000000\n"
+                          "#time=1d9a3c0d5e6f7a8\n"
+                          "#class=\"Odd\"\n"
+                          "\"Blob\"=hex:00,01,02,03,04,05,06,07,08,09,0a,0b,0c,"
+                          "0d,0e,0f,10,11,12,13,14,\\\n"
+                          "  15,16,17\n\n";
+  std::string touched = "[Software\\\\Roblox] 1700000000\n"
+                        "\"Theme\"=\"Dark\"\n\n";
+  std::string tail = "[Software\\\\Zed] 1700000000\n"
+                     "\"Val\"=dword:00000010\n";
+
+  fs::path regPath = testDir / "system.reg";
+  {
+    std::ofstream os(regPath);
+    os << head << untouched << touched << tail;
+  }
+
+  {
+    rsjfw::Registry reg(testDir.string(), rsjfw::Registry::LoadMode::Lazy);
+    EXPECT_EQ(reg.query("HKLM\\Software\\Zed", "Val"), "dword:00000010");
+    EXPECT_EQ(reg.query("HKLM\\SOFTWARE\\roblox", "Theme"), "Dark");
+    reg.add("HKLM\\Software\\Roblox", "Theme", "Light");
+    reg.add("HKLM\\Software\\New", "Val", "1");
+    ASSERT_TRUE(reg.commit());
+  }
+
+  std::ifstream is(regPath);
+  std::string out((std::istreambuf_iterator<char>(is)),
+                  std::istreambuf_iterator<char>());
+  EXPECT_EQ(out.substr(0, head.size() + untouched.size()), head + untouched);
+  EXPECT_NE(out.find(tail), std::string::npos);
+  EXPECT_NE(out.find("\"Theme\"=\"Light\""), std::string::npos);
+  EXPECT_EQ(out.find("\"Theme\"=\"Dark\""), std::string::npos);
+  EXPECT_NE(out.find("[Software\\\\New]"), std::string::npos);
+
+  rsjfw::Registry eager(testDir.string());
+  EXPECT_EQ(eager.query("HKLM\\Software\\Roblox", "Theme"), "Light");
+  EXPECT_EQ(eager.query("HKLM\\Software\\New", "Val"), "1");
+}
+
+TEST_F(RegistryVerifyTest, ReloadsHiveRewrittenBehindItsBack) {
+  std::string content = "WINE REGISTRY Version 2\n"
+                        ";; All keys relative to REGISTRY\\\\Machine\n\n"
+                        "[Software\\\\Test] 1700000000\n"
+                        "\"Str\"=\"Before\"\n";
+  fs::path regPath = testDir / "system.reg";
+  std::ofstream(regPath) << content;
+
+  rsjfw::Registry reg(testDir.string());
+  EXPECT_EQ(reg.query("HKLM\\Software\\Test", "Str").value_or(""), "Before");
+
+  // Our own commit must not look like an external rewrite.
+  reg.add("HKLM\\Software\\Test", "Own", "1");
+  ASSERT_TRUE(reg.commit());
+  EXPECT_EQ(reg.query("HKLM\\Software\\Test", "Own").value_or(""), "1");
+
+  // Rewrite the hive the way Wine does: a new file renamed over the old.
+  fs::path tmp = testDir / "system.reg.new";
+  std::ofstream(tmp) << content << "\"Str2\"=\"After\"\n";
+  fs::rename(tmp, regPath);
+
+  // Change notification is asynchronous; allow it a moment to arrive.
+  std::string seen;
+  for (int i = 0; i < 200 && seen.empty(); ++i) {
+    seen = reg.query("HKLM\\Software\\Test", "Str2").value_or("");
+    if (seen.empty())
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(seen, "After");
+}
@@ -0,0 +1,466 @@
+// rsjfw-reg: applies regedit .reg files to Wine prefixes and exports
+// registry subtrees as .reg files, without starting wineserver.
+//
+//   rsjfw-reg import -p <prefix> [-p <prefix>...] <file.reg>...
+//   rsjfw-reg export <prefix> <key> <out.reg>
+//
+// Input files are read in blocks and applied a batch of sections at a time,
+// so memory use does not grow with the size of the .reg file. All files are
+// applied to a prefix in one transaction and each hive is written once.
+
+#include "registry.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fs = std::filesystem;
+using rsjfw::Registry;
+
+static constexpr size_t kReadBlock = 256 << 10;
+static constexpr size_t kApplyBatch = 1 << 20;
+
+static void appendUtf8(std::string &out, uint32_t cp) {
+  if (cp < 0x80) {
+    out += static_cast<char>(cp);
+  } else if (cp < 0x800) {
+    out += static_cast<char>(0xc0 | (cp >> 6));
+    out += static_cast<char>(0x80 | (cp & 0x3f));
+  } else if (cp < 0x10000) {
+    out += static_cast<char>(0xe0 | (cp >> 12));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+    out += static_cast<char>(0x80 | (cp & 0x3f));
+  } else {
+    out += static_cast<char>(0xf0 | (cp >> 18));
+    out += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+    out += static_cast<char>(0x80 | (cp & 0x3f));
+  }
+}
+
+static void appendUtf16(std::string &out, uint32_t cp) {
+  auto unit = [&](uint32_t u) {
+    out += static_cast<char>(u & 0xff);
+    out += static_cast<char>(u >> 8);
+  };
+  if (cp < 0x10000) {
+    unit(cp);
+  } else {
+    cp -= 0x10000;
+    unit(0xd800 | (cp >> 10));
+    unit(0xdc00 | (cp & 0x3ff));
+  }
+}
+
+// UTF-8 text to UTF-16LE with CRLF line ends, as regedit writes. in holds
+// whole sequences; invalid bytes are passed through as U+FFFD.
+static void toRegeditUtf16(std::string_view in, std::string &out) {
+  out.clear();
+  for (size_t i = 0; i < in.size();) {
+    unsigned char c = in[i];
+    uint32_t cp;
+    size_t n;
+    if (c < 0x80) {
+      cp = c;
+      n = 1;
+    } else if ((c >> 5) == 6) {
+      cp = c & 0x1f;
+      n = 2;
+    } else if ((c >> 4) == 14) {
+      cp = c & 0x0f;
+      n = 3;
+    } else if ((c >> 3) == 30) {
+      cp = c & 0x07;
+      n = 4;
+    } else {
+      cp = 0xfffd;
+      n = 1;
+    }
+    if (i + n > in.size()) {
+      cp = 0xfffd;
+      n = in.size() - i;
+    } else {
+      for (size_t k = 1; k < n; ++k)
+        cp = (cp << 6) | (static_cast<unsigned char>(in[i + k]) & 0x3f);
+    }
+    if (cp == '\n')
+      appendUtf16(out, '\r');
+    appendUtf16(out, cp);
+    i += n;
+  }
+}
+
+// Splits "HKEY_CURRENT_USER\Software\X" into the hive it lives in ("HKLM"
+// or "HKCU") and the path below the hive root. Classes live in the machine
+// hive.
+static bool splitKey(std::string_view key, std::string &hive,
+                     std::string &path) {
+  size_t sep = key.find('\\');
+  std::string_view root = key.substr(0, sep);
+  std::string_view rest =
+      sep == std::string_view::npos ? std::string_view{} : key.substr(sep + 1);
+  while (!rest.empty() && rest.back() == '\\')
+    rest.remove_suffix(1);
+  rsjfw::CaseInsensitiveEqual eq;
+  path.clear();
+  if (eq(root, "HKEY_LOCAL_MACHINE") || eq(root, "HKLM")) {
+    hive = "HKLM";
+  } else if (eq(root, "HKEY_CURRENT_USER") || eq(root, "HKCU")) {
+    hive = "HKCU";
+  } else if (eq(root, "HKEY_CLASSES_ROOT") || eq(root, "HKCR")) {
+    hive = "HKLM";
+    path = "Software\\Classes";
+    if (!rest.empty())
+      path += '\\';
+  } else {
+    return false;
+  }
+  path.append(rest);
+  return true;
+}
+
+// Hive files escape backslashes and quotes in section paths.
+static void appendEscapedPath(std::string &out, std::string_view path) {
+  for (char c : path) {
+    if (c == '\\' || c == '"')
+      out += '\\';
+    out += c;
+  }
+}
+
+// Offset of the '=' separating a value's name from its data, or npos.
+static size_t valueSeparator(std::string_view line) {
+  size_t i = 0;
+  if (!line.empty() && line[0] == '"') {
+    i = 1;
+    while (i < line.size() && line[i] != '"')
+      i += line[i] == '\\' ? 2 : 1;
+  }
+  return line.find('=', std::min(i, line.size()));
+}
+
+// Streams one .reg file into a transaction, translating regedit syntax to
+// the hive syntax Transaction::apply() takes. Section paths are re-escaped
+// and rooted in their hive; value lines are already in the shared syntax,
+// except REGEDIT4's single-byte hex(2)/hex(7) strings.
+class RegImporter {
+public:
+  RegImporter(Registry::Transaction &tx, const fs::path &file)
+      : tx_(tx), file_(file) {}
+
+  bool run() {
+    std::ifstream in(file_, std::ios::binary);
+    if (!in) {
+      std::cerr << file_.string() << ": cannot open\n";
+      return false;
+    }
+    std::vector<char> block(kReadBlock);
+    bool first = true;
+    while (in) {
+      in.read(block.data(), static_cast<std::streamsize>(block.size()));
+      std::string_view data(block.data(), static_cast<size_t>(in.gcount()));
+      if (first) {
+        first = false;
+        if (data.substr(0, 2) == "\xff\xfe") {
+          wide_ = true;
+          data.remove_prefix(2);
+        } else if (data.substr(0, 3) == "\xef\xbb\xbf") {
+          data.remove_prefix(3);
+        }
+      }
+      if (wide_)
+        decodeWide(data);
+      else
+        text_.append(data);
+      if (!consumeLines(false))
+        return false;
+    }
+    if (!consumeLines(true))
+      return false;
+    return flush();
+  }
+
+private:
+  Registry::Transaction &tx_;
+  fs::path file_;
+  bool wide_ = false;
+  bool sawVersion_ = false;
+  bool regedit4_ = false;
+  bool skipping_ = false;
+  // batch_ holds nothing but the header replayed after a flush.
+  bool replayed_ = false;
+  uint32_t highSurrogate_ = 0;
+  std::string oddByte_;
+  std::string text_;
+  std::string logical_;
+  std::string hive_;
+  std::string header_;
+  std::string batch_;
+
+  void decodeWide(std::string_view data) {
+    std::string bytes;
+    if (!oddByte_.empty()) {
+      bytes = oddByte_;
+      bytes.append(data);
+      data = bytes;
+      oddByte_.clear();
+    }
+    size_t n = data.size() & ~size_t(1);
+    for (size_t i = 0; i < n; i += 2) {
+      uint32_t u = static_cast<unsigned char>(data[i]) |
+                   (static_cast<unsigned char>(data[i + 1]) << 8);
+      if (u >= 0xd800 && u < 0xdc00) {
+        highSurrogate_ = u;
+        continue;
+      }
+      if (u >= 0xdc00 && u < 0xe000 && highSurrogate_) {
+        u = 0x10000 + ((highSurrogate_ - 0xd800) << 10) + (u - 0xdc00);
+      }
+      highSurrogate_ = 0;
+      if (u != '\r')
+        appendUtf8(text_, u);
+    }
+    if (n < data.size())
+      oddByte_.assign(data.substr(n));
+  }
+
+  // Handles every complete line in text_; at eof the remainder too.
+  bool consumeLines(bool eof) {
+    size_t pos = 0;
+    while (pos < text_.size()) {
+      size_t nl = text_.find('\n', pos);
+      if (nl == std::string::npos && !eof)
+        break;
+      size_t end = nl == std::string::npos ? text_.size() : nl;
+      std::string_view line(text_.data() + pos, end - pos);
+      if (!line.empty() && line.back() == '\r')
+        line.remove_suffix(1);
+      pos = end + 1;
+      if (!line.empty() && line.back() == '\\') {
+        // Continued value: regedit indents the next line, and the hive
+        // parser joins the pieces the same way, so keep them verbatim.
+        logical_.append(line);
+        logical_ += '\n';
+        continue;
+      }
+      logical_.append(line);
+      bool ok = handleLine(logical_);
+      logical_.clear();
+      if (!ok)
+        return false;
+    }
+    text_.erase(0, std::min(pos, text_.size()));
+    return true;
+  }
+
+  bool handleLine(std::string_view line) {
+    size_t lead = line.find_first_not_of(" \t");
+    if (lead == std::string_view::npos)
+      return true;
+    line.remove_prefix(lead);
+    if (!sawVersion_) {
+      sawVersion_ = true;
+      if (line == "REGEDIT4") {
+        regedit4_ = true;
+        return true;
+      }
+      if (line.substr(0, 36) == "Windows Registry Editor Version 5.00")
+        return true;
+      std::cerr << file_.string() << ": not a .reg file\n";
+      return false;
+    }
+    if (line[0] == ';')
+      return true;
+    if (line[0] == '[')
+      return section(line);
+    if (skipping_ || header_.empty())
+      return true;
+    if (!regedit4_ || !narrowStringValue(line)) {
+      batch_.append(line);
+      batch_ += '\n';
+    }
+    replayed_ = false;
+    return batch_.size() < kApplyBatch || flush();
+  }
+
+  bool section(std::string_view line) {
+    size_t close = line.rfind(']');
+    if (close == std::string_view::npos)
+      return true;
+    std::string_view key = line.substr(1, close - 1);
+    bool del = !key.empty() && key[0] == '-';
+    if (del)
+      key.remove_prefix(1);
+    std::string hive, path;
+    if (!splitKey(key, hive, path)) {
+      std::cerr << file_.string() << ": skipping [" << key
+                << "]: unsupported root\n";
+      skipping_ = true;
+      return true;
+    }
+    skipping_ = false;
+    if (hive != hive_) {
+      if (!flush())
+        return false;
+      batch_.clear();
+      hive_ = hive;
+    }
+    header_ = "[";
+    if (del)
+      header_ += '-';
+    appendEscapedPath(header_, path);
+    header_ += "]\n";
+    batch_ += header_;
+    replayed_ = false;
+    // Values after a deletion header belong to no key; a later batch must
+    // not replay the deletion either.
+    if (del)
+      header_.clear();
+    return true;
+  }
+
+  // REGEDIT4 writes hex(2)/hex(7) strings one byte per character, while the
+  // hive syntax reads them as UTF-16LE; rewrite them as str(2)/str(7).
+  bool narrowStringValue(std::string_view line) {
+    size_t eq = valueSeparator(line);
+    if (eq == std::string_view::npos)
+      return false;
+    std::string_view data = line.substr(eq + 1);
+    size_t lead = data.find_first_not_of(" \t");
+    data.remove_prefix(std::min(lead, data.size()));
+    bool multi = data.substr(0, 7) == "hex(7):";
+    if (!multi && data.substr(0, 7) != "hex(2):")
+      return false;
+    auto hex = [&](size_t i) {
+      return i < data.size() &&
+             std::isxdigit(static_cast<unsigned char>(data[i]));
+    };
+    std::string str;
+    for (size_t i = 7; i < data.size();) {
+      while (i < data.size() && !hex(i))
+        ++i;
+      size_t start = i;
+      while (hex(i))
+        ++i;
+      if (i == start)
+        break;
+      str += static_cast<char>(
+          std::stoul(std::string(data.substr(start, i - start)), nullptr, 16));
+    }
+    while (!str.empty() && str.back() == '\0')
+      str.pop_back();
+    batch_.append(line.substr(0, eq));
+    batch_ += multi ? "=str(7):\"" : "=str(2):\"";
+    // Multi-string separators stay raw NULs, which the hive parser keeps.
+    for (char c : str) {
+      if (c == '\\' || c == '"')
+        batch_ += '\\';
+      batch_ += c;
+    }
+    batch_ += "\"\n";
+    return true;
+  }
+
+  // Applies the pending batch. The next batch opens with the current key's
+  // header, since the lines after it may still add values to that key.
+  bool flush() {
+    if (batch_.empty() || replayed_)
+      return true;
+    bool ok = tx_.apply(hive_, batch_);
+    batch_.clear();
+    if (!ok) {
+      std::cerr << file_.string() << ": failed to apply to " << hive_ << "\n";
+      return false;
+    }
+    batch_ = header_;
+    replayed_ = true;
+    return true;
+  }
+};
+
+static int importFiles(const std::vector<std::string> &prefixes,
+                       const std::vector<std::string> &files) {
+  int rc = 0;
+  for (const auto &p : prefixes) {
+    if (!fs::is_directory(p)) {
+      std::cerr << p << ": not a directory\n";
+      rc = 1;
+      continue;
+    }
+    Registry reg(p, Registry::LoadMode::Lazy);
+    Registry::Transaction tx(reg);
+    bool ok = true;
+    for (const auto &f : files)
+      ok = RegImporter(tx, f).run() && ok;
+    if (!tx.commit()) {
+      std::cerr << p << ": failed to write registry\n";
+      ok = false;
+    }
+    if (!ok)
+      rc = 1;
+  }
+  return rc;
+}
+
+static int exportKey(const std::string &prefix, const std::string &key,
+                     const std::string &outPath) {
+  std::string hive, path;
+  if (!splitKey(key, hive, path)) {
+    std::cerr << key << ": unsupported root\n";
+    return 1;
+  }
+  std::ofstream os(outPath, std::ios::binary | std::ios::trunc);
+  if (!os) {
+    std::cerr << outPath << ": cannot open\n";
+    return 1;
+  }
+  std::string wide = "\xff\xfe";
+  os.write(wide.data(), static_cast<std::streamsize>(wide.size()));
+  toRegeditUtf16("Windows Registry Editor Version 5.00\n\n", wide);
+  os.write(wide.data(), static_cast<std::streamsize>(wide.size()));
+
+  Registry reg(prefix, Registry::LoadMode::Lazy);
+  std::string regPath = path.empty() ? hive : hive + "\\" + path;
+  bool found = reg.exportReg(regPath, [&](std::string_view chunk) {
+    toRegeditUtf16(chunk, wide);
+    os.write(wide.data(), static_cast<std::streamsize>(wide.size()));
+  });
+  if (!found) {
+    std::cerr << key << ": no such key\n";
+    return 1;
+  }
+  return os ? 0 : 1;
+}
+
+static int usage() {
+  std::cerr << "Usage: rsjfw-reg import -p <prefix> [-p <prefix>...] "
+               "<file.reg>...\n"
+               "       rsjfw-reg export <prefix> <key> <out.reg>\n";
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2)
+    return usage();
+  std::string cmd = argv[1];
+  if (cmd == "import") {
+    std::vector<std::string> prefixes, files;
+    for (int i = 2; i < argc; ++i) {
+      if (std::strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        prefixes.push_back(argv[++i]);
+      else
+        files.push_back(argv[i]);
+    }
+    if (prefixes.empty() || files.empty())
+      return usage();
+    return importFiles(prefixes, files);
+  }
+  if (cmd == "export" && argc == 5)
+    return exportKey(argv[2], argv[3], argv[4]);
+  return usage();
+}